@@ -0,0 +1,479 @@
+#include "SoapyMiriAggregate.hpp"
+#include <SoapySDR/Logger.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+SoapyMiriAggregate::SoapyMiriAggregate(const SoapySDR::Kwargs &args) :
+        elemSize(0),
+        nextTick(0),
+        nextTickValid(false),
+        lastAlignDrop(0),
+        alignDropEvents(0) {
+    serials = parseSerials(args.count("serials") != 0 ? args.at("serials") : "");
+    if (serials.size() < 2) {
+        throw std::runtime_error("SoapyMiri aggregate needs at least two serials (serials=A;B)");
+    }
+
+    // simulated dongles (`simulate=...`) stand in for hardware, the serials only name them
+    const bool simulated = args.count("simulate") != 0 && args.at("simulate") != "false";
+
+    for (const auto &serial : serials) {
+        // the remaining device args (sample_format, ...) apply to every dongle
+        SoapySDR::Kwargs memberArgs = args;
+        memberArgs.erase("serials");
+        memberArgs.erase("channels");
+        memberArgs.erase("channel_offsets");
+        if (simulated) {
+            memberArgs["label"] = "MiriSDR simulated :: " + serial;
+        } else {
+            SoapySDR::Kwargs query;
+            query["serial"] = serial;
+            const auto found = SoapyMiri::findMiriSDR(query);
+            if (found.empty()) {
+                throw std::runtime_error("SoapyMiri aggregate: no device with serial " + serial);
+            }
+            memberArgs["index"] = found.front().at("index");
+            memberArgs["label"] = found.front().at("label");
+        }
+        members.emplace_back(new SoapyMiri(memberArgs));
+    }
+    counterOffsets.assign(members.size(), 0);
+}
+
+std::vector<std::string> SoapyMiriAggregate::parseSerials(const std::string &serials) {
+    // ',' already separates the device args, so the serials are split by ';' or spaces
+    std::vector<std::string> result;
+    size_t start = 0;
+    while (start < serials.size()) {
+        size_t end = serials.find_first_of("; ", start);
+        if (end == std::string::npos) {
+            end = serials.size();
+        }
+        if (end > start) {
+            result.push_back(serials.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
+SoapyMiri &SoapyMiriAggregate::member(const size_t channel) const {
+    if (channel >= members.size()) {
+        throw std::runtime_error("SoapyMiri aggregate: invalid channel " + std::to_string(channel));
+    }
+    return *members[channel];
+}
+
+/*******************************************************************
+ * Identification API
+ ******************************************************************/
+
+std::string SoapyMiriAggregate::getDriverKey(void) const {
+    return "MIRI";
+}
+
+std::string SoapyMiriAggregate::getHardwareKey(void) const {
+    return "RSP1 aggregate";
+}
+
+SoapySDR::Kwargs SoapyMiriAggregate::getHardwareInfo(void) const {
+    SoapySDR::Kwargs args;
+
+    args["origin"] = "https://github.com/ericek111/SoapyMiri";
+    for (size_t i = 0; i < serials.size(); i++) {
+        args["serial" + std::to_string(i)] = serials[i];
+    }
+
+    return args;
+}
+
+/*******************************************************************
+ * Channels API
+ ******************************************************************/
+
+size_t SoapyMiriAggregate::getNumChannels(const int dir) const {
+    return (dir == SOAPY_SDR_RX) ? members.size() : 0;
+}
+
+bool SoapyMiriAggregate::getFullDuplex(const int direction, const size_t channel) const {
+    return false;
+}
+
+/*******************************************************************
+ * Stream API
+ ******************************************************************/
+
+std::vector<std::string> SoapyMiriAggregate::getStreamFormats(const int direction, const size_t channel) const {
+    return member(channel).getStreamFormats(direction, 0);
+}
+
+std::string SoapyMiriAggregate::getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const {
+    return member(channel).getNativeStreamFormat(direction, 0, fullScale);
+}
+
+SoapySDR::ArgInfoList SoapyMiriAggregate::getStreamArgsInfo(const int direction, const size_t channel) const {
+    return member(channel).getStreamArgsInfo(direction, 0);
+}
+
+SoapySDR::Stream *SoapyMiriAggregate::setupStream(
+        const int direction,
+        const std::string &format,
+        const std::vector<size_t> &channels,
+        const SoapySDR::Kwargs &args
+) {
+    streamChannels = channels;
+    if (streamChannels.empty()) {
+        streamChannels.push_back(0);
+    }
+
+    if (format == SOAPY_SDR_CS16) {
+        elemSize = sizeof(int16_t) * 2;
+    } else if (format == SOAPY_SDR_CF32) {
+        elemSize = sizeof(float) * 2;
+    } else if (format == SOAPY_SDR_CS8) {
+        elemSize = sizeof(int8_t) * 2;
+    } else {
+        throw std::runtime_error("setupStream: invalid format '" + format + "', only CS16, CF32 and CS8 are supported by SoapyMiri.");
+    }
+
+    // every dongle fills whole requests, so the channels only need lining up after drops
+    SoapySDR::Kwargs memberArgs = args;
+    memberArgs["fillRead"] = "true";
+
+    memberStreams.clear();
+    for (const auto channel : streamChannels) {
+        memberStreams.push_back(member(channel).setupStream(direction, format, {0}, memberArgs));
+    }
+    staged.assign(streamChannels.size(), Staged());
+    nextTickValid = false;
+
+    return (SoapySDR::Stream *) this;
+}
+
+void SoapyMiriAggregate::closeStream(SoapySDR::Stream *stream) {
+    for (size_t i = 0; i < streamChannels.size(); i++) {
+        member(streamChannels[i]).closeStream(memberStreams[i]);
+    }
+    memberStreams.clear();
+}
+
+size_t SoapyMiriAggregate::getStreamMTU(SoapySDR::Stream *stream) const {
+    return member(streamChannels.front()).getStreamMTU(memberStreams.front());
+}
+
+int SoapyMiriAggregate::activateStream(
+        SoapySDR::Stream *stream,
+        const int flags,
+        const long long timeNs,
+        const size_t numElems
+) {
+    for (size_t i = 0; i < streamChannels.size(); i++) {
+        int ret = member(streamChannels[i]).activateStream(memberStreams[i], flags, timeNs, numElems);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    // what was staged is from before the activation
+    for (auto &channel : staged) {
+        channel.count = 0;
+    }
+    nextTickValid = false;
+    return 0;
+}
+
+int SoapyMiriAggregate::deactivateStream(SoapySDR::Stream *stream, const int flags, const long long timeNs) {
+    for (size_t i = 0; i < streamChannels.size(); i++) {
+        member(streamChannels[i]).deactivateStream(memberStreams[i], flags, timeNs);
+    }
+    return 0;
+}
+
+int SoapyMiriAggregate::fillStaged(const size_t index, const size_t numElems, const long timeoutUs) {
+    Staged &channel = staged[index];
+    SoapyMiri &device = member(streamChannels[index]);
+
+    channel.data.resize(std::max(channel.data.size(), numElems * elemSize));
+    channel.offset = 0;
+    channel.count = 0;
+
+    int flags = 0;
+    long long timeNs = 0;
+    void *buffs[] = {channel.data.data()};
+    const int ret = device.readStream(memberStreams[index], buffs, numElems, flags, timeNs, timeoutUs);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    // the member's timestamps come from its sample counter, map them back to the exact count
+    channel.count = (size_t) ret;
+    channel.tick = (long long) device.timeNsToTicks(timeNs) + counterOffsets[streamChannels[index]];
+    return ret;
+}
+
+int SoapyMiriAggregate::readStream(
+        SoapySDR::Stream *stream,
+        void *const *buffs,
+        const size_t numElems,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs
+) {
+    const size_t numChannels = staged.size();
+
+    // the timeout covers the whole call, not every dongle's read on its own
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+    auto remainingUs = [&deadline] {
+        const auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+        return std::max<long>(0, (long) left.count());
+    };
+
+    size_t produced = 0;
+    long long firstTick = 0;
+    long long alignDrop = 0;
+    while (produced < numElems) {
+        // refill the channels that ran dry, what the others still have stays staged
+        int ret = 0;
+        for (size_t i = 0; i < numChannels && ret >= 0; i++) {
+            if (staged[i].count == 0) {
+                ret = this->fillStaged(i, numElems - produced, remainingUs());
+            }
+        }
+        if (ret < 0 || std::any_of(staged.begin(), staged.end(), [](const Staged &c) { return c.count == 0; })) {
+            if (produced == 0 && ret < 0) {
+                return ret;
+            }
+            if (produced == 0 && remainingUs() > 0) {
+                continue;
+            }
+            break;
+        }
+
+        // line up on the latest start: a channel behind it is missing nothing the others have,
+        // it just has samples the others lost (or never had), those are dropped
+        long long start = staged.front().tick;
+        for (const auto &channel : staged) {
+            start = std::max(start, channel.tick);
+        }
+        bool short_ = false;
+        for (auto &channel : staged) {
+            const size_t drop = (size_t) std::min<long long>(start - channel.tick, (long long) channel.count);
+            alignDrop = std::max(alignDrop, (long long) drop);
+            channel.offset += drop;
+            channel.count -= drop;
+            channel.tick += drop;
+            short_ |= (channel.count == 0);
+        }
+        if (short_) {
+            continue;
+        }
+
+        // one call only returns contiguous samples, a gap waits for the next call
+        if (produced != 0 && start != firstTick + (long long) produced) {
+            break;
+        }
+        if (produced == 0) {
+            firstTick = start;
+        }
+
+        size_t n = numElems - produced;
+        for (const auto &channel : staged) {
+            n = std::min(n, channel.count);
+        }
+        for (size_t i = 0; i < numChannels; i++) {
+            Staged &channel = staged[i];
+            std::memcpy((char *) buffs[i] + produced * elemSize, channel.data.data() + channel.offset * elemSize, n * elemSize);
+            channel.offset += n;
+            channel.count -= n;
+            channel.tick += n;
+        }
+        produced += n;
+    }
+
+    lastAlignDrop = alignDrop;
+    if (alignDrop != 0) {
+        alignDropEvents++;
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "SoapyMiri aggregate dropped %lld samples to line up the counters", alignDrop);
+    }
+
+    // the timestamp is on the first channel's counter
+    const SoapyMiri &reference = member(streamChannels.front());
+    flags = SOAPY_SDR_HAS_TIME;
+    timeNs = reference.ticksToTimeNs((unsigned long long) std::max<long long>(0, firstTick - counterOffsets[streamChannels.front()]));
+    if (nextTickValid && firstTick != nextTick) {
+        flags |= SOAPY_SDR_END_ABRUPT;
+    }
+    nextTick = firstTick + (long long) produced;
+    nextTickValid = true;
+
+    return (int) produced;
+}
+
+/*******************************************************************
+ * Antenna API
+ ******************************************************************/
+
+std::vector<std::string> SoapyMiriAggregate::listAntennas(const int direction, const size_t channel) const {
+    return member(channel).listAntennas(direction, 0);
+}
+
+void SoapyMiriAggregate::setAntenna(const int direction, const size_t channel, const std::string &name) {
+    member(channel).setAntenna(direction, 0, name);
+}
+
+std::string SoapyMiriAggregate::getAntenna(const int direction, const size_t channel) const {
+    return member(channel).getAntenna(direction, 0);
+}
+
+/*******************************************************************
+ * Gain API
+ ******************************************************************/
+
+std::vector<std::string> SoapyMiriAggregate::listGains(const int direction, const size_t channel) const {
+    return member(channel).listGains(direction, 0);
+}
+
+bool SoapyMiriAggregate::hasGainMode(const int direction, const size_t channel) const {
+    return member(channel).hasGainMode(direction, 0);
+}
+
+void SoapyMiriAggregate::setGainMode(const int direction, const size_t channel, const bool automatic) {
+    member(channel).setGainMode(direction, 0, automatic);
+}
+
+bool SoapyMiriAggregate::getGainMode(const int direction, const size_t channel) const {
+    return member(channel).getGainMode(direction, 0);
+}
+
+void SoapyMiriAggregate::setGain(const int direction, const size_t channel, const double value) {
+    member(channel).setGain(direction, 0, value);
+}
+
+void SoapyMiriAggregate::setGain(const int direction, const size_t channel, const std::string &name, const double value) {
+    member(channel).setGain(direction, 0, name, value);
+}
+
+double SoapyMiriAggregate::getGain(const int direction, const size_t channel, const std::string &name) const {
+    return member(channel).getGain(direction, 0, name);
+}
+
+SoapySDR::Range SoapyMiriAggregate::getGainRange(const int direction, const size_t channel, const std::string &name) const {
+    return member(channel).getGainRange(direction, 0, name);
+}
+
+/*******************************************************************
+ * Frequency API
+ ******************************************************************/
+
+void SoapyMiriAggregate::setFrequency(
+        const int direction,
+        const size_t channel,
+        const std::string &name,
+        const double frequency,
+        const SoapySDR::Kwargs &args
+) {
+    member(channel).setFrequency(direction, 0, name, frequency, args);
+}
+
+double SoapyMiriAggregate::getFrequency(const int direction, const size_t channel, const std::string &name) const {
+    return member(channel).getFrequency(direction, 0, name);
+}
+
+std::vector<std::string> SoapyMiriAggregate::listFrequencies(const int direction, const size_t channel) const {
+    return member(channel).listFrequencies(direction, 0);
+}
+
+SoapySDR::RangeList SoapyMiriAggregate::getFrequencyRange(
+        const int direction,
+        const size_t channel,
+        const std::string &name) const {
+    return member(channel).getFrequencyRange(direction, 0, name);
+}
+
+SoapySDR::ArgInfoList SoapyMiriAggregate::getFrequencyArgsInfo(const int direction, const size_t channel) const {
+    return member(channel).getFrequencyArgsInfo(direction, 0);
+}
+
+/*******************************************************************
+ * Sample Rate API
+ ******************************************************************/
+
+void SoapyMiriAggregate::setSampleRate(const int direction, const size_t channel, const double rate) {
+    // channels are only comparable at one rate, so it always applies to all dongles
+    for (auto &device : members) {
+        device->setSampleRate(direction, 0, rate);
+    }
+}
+
+double SoapyMiriAggregate::getSampleRate(const int direction, const size_t channel) const {
+    return member(channel).getSampleRate(direction, 0);
+}
+
+std::vector<double> SoapyMiriAggregate::listSampleRates(const int direction, const size_t channel) const {
+    return member(channel).listSampleRates(direction, 0);
+}
+
+SoapySDR::RangeList SoapyMiriAggregate::getSampleRateRange(const int direction, const size_t channel) const {
+    return member(channel).getSampleRateRange(direction, 0);
+}
+
+void SoapyMiriAggregate::setBandwidth(const int direction, const size_t channel, const double bw) {
+    member(channel).setBandwidth(direction, 0, bw);
+}
+
+double SoapyMiriAggregate::getBandwidth(const int direction, const size_t channel) const {
+    return member(channel).getBandwidth(direction, 0);
+}
+
+std::vector<double> SoapyMiriAggregate::listBandwidths(const int direction, const size_t channel) const {
+    return member(channel).listBandwidths(direction, 0);
+}
+
+SoapySDR::RangeList SoapyMiriAggregate::getBandwidthRange(const int direction, const size_t channel) const {
+    return member(channel).getBandwidthRange(direction, 0);
+}
+
+/*******************************************************************
+ * Settings API
+ ******************************************************************/
+
+SoapySDR::ArgInfoList SoapyMiriAggregate::getSettingInfo(void) const {
+    return member(0).getSettingInfo();
+}
+
+void SoapyMiriAggregate::writeSetting(const std::string &key, const std::string &value) {
+    for (auto &device : members) {
+        device->writeSetting(key, value);
+    }
+}
+
+std::string SoapyMiriAggregate::readSetting(const std::string &key) const {
+    if (key == "align_drop") {
+        // most samples a channel dropped in the last read to line up the counters
+        return std::to_string(lastAlignDrop);
+    } else if (key == "align_drop_events") {
+        return std::to_string(alignDropEvents);
+    }
+
+    return member(0).readSetting(key);
+}
+
+void SoapyMiriAggregate::writeSetting(const int direction, const size_t channel, const std::string &key, const std::string &value) {
+    if (key == "counter_offset") {
+        // samples this dongle's counter lags the others, e.g. measured on a common reference signal
+        member(channel);
+        counterOffsets[channel] = std::stoll(value);
+        return;
+    }
+    member(channel).writeSetting(key, value);
+}
+
+std::string SoapyMiriAggregate::readSetting(const int direction, const size_t channel, const std::string &key) const {
+    if (key == "counter_offset") {
+        member(channel);
+        return std::to_string(counterOffsets[channel]);
+    }
+    return member(channel).readSetting(key);
+}
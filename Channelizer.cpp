@@ -0,0 +1,130 @@
+#include "Channelizer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+MiriChannelizer::MiriChannelizer(size_t numBins, const std::vector<size_t> &bins, size_t tapsPerBranch) :
+        _numBins(numBins),
+        _taps(tapsPerBranch),
+        _bins(bins) {
+    if (numBins < 2 || (numBins & (numBins - 1)) != 0) {
+        throw std::runtime_error("MiriChannelizer: the number of channels must be a power of two");
+    }
+    for (const auto bin : bins) {
+        if (bin >= numBins) {
+            throw std::runtime_error("MiriChannelizer: channel bin out of range");
+        }
+    }
+
+    // Blackman windowed sinc, cut off at half the channel spacing, unity gain at DC
+    const size_t length = _numBins * _taps;
+    _window.resize(length);
+    double sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        const double t = (double) i - (length - 1) / 2.0;
+        const double x = M_PI * t / _numBins;
+        const double sinc = (t == 0) ? 1.0 : std::sin(x) / x;
+        const double blackman = 0.42 - 0.5 * std::cos(2 * M_PI * i / (length - 1)) +
+                                0.08 * std::cos(4 * M_PI * i / (length - 1));
+        _window[i] = (float) (sinc * blackman);
+        sum += _window[i];
+    }
+    for (auto &tap : _window) {
+        tap = (float) (tap / sum);
+    }
+
+    _histI.assign(length, 0.0f);
+    _histQ.assign(length, 0.0f);
+    _re.resize(_numBins);
+    _im.resize(_numBins);
+
+    _twiddleRe.resize(_numBins / 2);
+    _twiddleIm.resize(_numBins / 2);
+    for (size_t k = 0; k < _numBins / 2; k++) {
+        _twiddleRe[k] = (float) std::cos(-2 * M_PI * k / _numBins);
+        _twiddleIm[k] = (float) std::sin(-2 * M_PI * k / _numBins);
+    }
+
+    size_t bits = 0;
+    while (((size_t) 1 << bits) < _numBins) {
+        bits++;
+    }
+    _bitReverse.resize(_numBins);
+    for (size_t i = 0; i < _numBins; i++) {
+        size_t reversed = 0;
+        for (size_t b = 0; b < bits; b++) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        _bitReverse[i] = reversed;
+    }
+}
+
+void MiriChannelizer::fft(void) {
+    for (size_t i = 0; i < _numBins; i++) {
+        const size_t j = _bitReverse[i];
+        if (i < j) {
+            std::swap(_re[i], _re[j]);
+            std::swap(_im[i], _im[j]);
+        }
+    }
+
+    for (size_t half = 1; half < _numBins; half *= 2) {
+        const size_t stride = _numBins / (half * 2);
+        for (size_t start = 0; start < _numBins; start += half * 2) {
+            for (size_t k = 0; k < half; k++) {
+                const float wr = _twiddleRe[k * stride];
+                const float wi = _twiddleIm[k * stride];
+                const size_t a = start + k;
+                const size_t b = a + half;
+                const float tr = _re[b] * wr - _im[b] * wi;
+                const float ti = _re[b] * wi + _im[b] * wr;
+                _re[b] = _re[a] - tr;
+                _im[b] = _im[a] - ti;
+                _re[a] += tr;
+                _im[a] += ti;
+            }
+        }
+    }
+}
+
+size_t MiriChannelizer::process(const int16_t *in, size_t numElems, float *const *outs, float scale) {
+    const size_t length = _numBins * _taps;
+    const size_t numOut = numElems / _numBins;
+
+    for (size_t m = 0; m < numOut; m++) {
+        // slide the history by one block and append the new samples
+        std::memmove(_histI.data(), _histI.data() + _numBins, sizeof(float) * (length - _numBins));
+        std::memmove(_histQ.data(), _histQ.data() + _numBins, sizeof(float) * (length - _numBins));
+        float *newI = _histI.data() + length - _numBins;
+        float *newQ = _histQ.data() + length - _numBins;
+        const int16_t *block = in + m * _numBins * 2;
+        for (size_t n = 0; n < _numBins; n++) {
+            newI[n] = (float) block[n * 2 + 0] * scale;
+            newQ[n] = (float) block[n * 2 + 1] * scale;
+        }
+
+        // window and fold the branches, the history always starts on a block boundary
+        // so there's no per-block phase rotation left to correct
+        std::fill(_re.begin(), _re.end(), 0.0f);
+        std::fill(_im.begin(), _im.end(), 0.0f);
+        for (size_t p = 0; p < _taps; p++) {
+            const float *w = _window.data() + p * _numBins;
+            const float *hi = _histI.data() + p * _numBins;
+            const float *hq = _histQ.data() + p * _numBins;
+            for (size_t n = 0; n < _numBins; n++) {
+                _re[n] += hi[n] * w[n];
+                _im[n] += hq[n] * w[n];
+            }
+        }
+
+        fft();
+
+        for (size_t c = 0; c < _bins.size(); c++) {
+            outs[c][m * 2 + 0] = _re[_bins[c]];
+            outs[c][m * 2 + 1] = _im[_bins[c]];
+        }
+    }
+
+    return numOut;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*!
+ * Critically sampled polyphase filter bank channelizer.
+ * Splits the wideband stream into `numBins` equally spaced channels (bin k centred at
+ * k * rate / numBins) and hands out a selection of them, each at rate / numBins.
+ * The windowed fold runs over contiguous float arrays so the compiler can vectorize it,
+ * one radix-2 FFT per output sample produces all bins at once.
+ */
+class MiriChannelizer {
+public:
+    MiriChannelizer(size_t numBins, const std::vector<size_t> &bins, size_t tapsPerBranch = 8);
+
+    /*!
+     * Consume `numElems` interleaved int16 I/Q input samples (a multiple of numBins) and write
+     * numElems / numBins CF32 samples into outs[c] for every selected bin c.
+     * Returns the number of output samples per channel.
+     */
+    size_t process(const int16_t *in, size_t numElems, float *const *outs, float scale);
+
+    size_t numBins(void) const { return _numBins; }
+
+    const std::vector<size_t> &bins(void) const { return _bins; }
+
+    // select other bins (same count), the filter state carries over
+    void setBins(const std::vector<size_t> &bins) { _bins = bins; }
+
+private:
+    void fft(void);
+
+    size_t _numBins;
+    size_t _taps;
+    std::vector<size_t> _bins;
+    std::vector<float> _window; // prototype lowpass, _numBins * _taps
+    std::vector<float> _histI, _histQ; // most recent _numBins * _taps input samples, oldest first
+    std::vector<float> _re, _im; // folded block, transformed in place
+    std::vector<float> _twiddleRe, _twiddleIm;
+    std::vector<size_t> _bitReverse;
+};
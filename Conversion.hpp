@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+typedef enum miriSampleFormat {
+    MIRI_FORMAT_CS16,
+    MIRI_FORMAT_CF32,
+    MIRI_FORMAT_CS8,
+} miriSampleFormat;
+
+/*!
+ * State carried between calls into a conversion kernel.
+ * The DC estimate is updated once per call (block-wise), so the per-sample loop has no
+ * serial dependency; its sums are integers, so with DC removal or power on it still
+ * vectorizes without reassociation flags.
+ */
+struct MiriConvertState {
+    float scale = 1.0f; // total scale, including the format's full-scale factor
+    float dcAlpha = 0.05f; // DC tracking speed per converted block
+    float dcI = 0.0f;
+    float dcQ = 0.0f;
+    double powerSum = 0.0; // sum of I^2 + Q^2 in int16 full scale units
+    unsigned long long powerCount = 0;
+};
+
+typedef void (*MiriConvertFn)(const int16_t *in, void *out, size_t numElems, MiriConvertState &state);
+
+template <miriSampleFormat FORMAT>
+struct MiriFormatTraits;
+
+template <>
+struct MiriFormatTraits<MIRI_FORMAT_CS16> {
+    typedef int16_t type;
+    static constexpr float fullScale = 1.0f;
+
+    static inline type fromFloat(float v) {
+        v = v > 32767.0f ? 32767.0f : v;
+        v = v < -32768.0f ? -32768.0f : v;
+        return (type) v;
+    }
+};
+
+template <>
+struct MiriFormatTraits<MIRI_FORMAT_CF32> {
+    typedef float type;
+    static constexpr float fullScale = 1.0f / 32768.0f;
+
+    static inline type fromFloat(float v) {
+        return v;
+    }
+};
+
+template <>
+struct MiriFormatTraits<MIRI_FORMAT_CS8> {
+    typedef int8_t type;
+    static constexpr float fullScale = 1.0f / 256.0f;
+
+    static inline type fromFloat(float v) {
+        v = v > 127.0f ? 127.0f : v;
+        v = v < -128.0f ? -128.0f : v;
+        return (type) v;
+    }
+};
+
+/*!
+ * Single pass over the samples: scale into the output format, optionally subtract the DC
+ * estimate and accumulate power. Every enabled stage shares the one memory traversal.
+ * The sums are taken on the raw int16 samples (exact, 64 bits for the power), the power
+ * around the DC estimate follows from them once per block.
+ */
+template <miriSampleFormat FORMAT, bool DC_REMOVAL, bool POWER>
+void miriConvert(const int16_t *in, void *out, size_t numElems, MiriConvertState &state) {
+    typedef typename MiriFormatTraits<FORMAT>::type outType;
+    auto *target = (outType *) out;
+
+    const float scale = state.scale;
+    const float dcI = DC_REMOVAL ? state.dcI : 0.0f;
+    const float dcQ = DC_REMOVAL ? state.dcQ : 0.0f;
+    int64_t sumI = 0, sumQ = 0, power = 0;
+
+    for (size_t i = 0; i < numElems; i++) {
+        const int32_t ii = in[i * 2 + 0];
+        const int32_t iq = in[i * 2 + 1];
+        if (DC_REMOVAL || POWER) {
+            sumI += ii;
+            sumQ += iq;
+        }
+        if (POWER) {
+            power += (int64_t) ii * ii + (int64_t) iq * iq;
+        }
+        target[i * 2 + 0] = MiriFormatTraits<FORMAT>::fromFloat(((float) ii - dcI) * scale);
+        target[i * 2 + 1] = MiriFormatTraits<FORMAT>::fromFloat(((float) iq - dcQ) * scale);
+    }
+
+    // sum of (x - dc)^2 = sum x^2 - 2 dc sum x + n dc^2, with the DC estimate this block used
+    if (POWER) {
+        state.powerSum += (double) power
+                          - 2.0 * ((double) dcI * (double) sumI + (double) dcQ * (double) sumQ)
+                          + (double) numElems * ((double) dcI * dcI + (double) dcQ * dcQ);
+        state.powerCount += numElems;
+    }
+    if (DC_REMOVAL && numElems != 0) {
+        state.dcI += state.dcAlpha * ((float) ((double) sumI / numElems) - state.dcI);
+        state.dcQ += state.dcAlpha * ((float) ((double) sumQ / numElems) - state.dcQ);
+    }
+}
+
+// native format without any processing: nothing to convert
+inline void miriConvertCopy(const int16_t *in, void *out, size_t numElems, MiriConvertState &) {
+    std::memcpy(out, in, sizeof(int16_t) * 2 * numElems);
+}
+
+template <miriSampleFormat FORMAT>
+MiriConvertFn miriSelectConverter(bool dcRemoval, bool power) {
+    if (dcRemoval) {
+        return power ? &miriConvert<FORMAT, true, true> : &miriConvert<FORMAT, true, false>;
+    }
+    return power ? &miriConvert<FORMAT, false, true> : &miriConvert<FORMAT, false, false>;
+}
+
+/*!
+ * Pick the kernel for a stream configuration, done once in setupStream.
+ * Also initializes the state's scale for the chosen output format.
+ */
+inline MiriConvertFn miriSelectConverter(
+        miriSampleFormat format,
+        bool dcRemoval,
+        bool power,
+        float scale,
+        MiriConvertState &state) {
+    state = MiriConvertState();
+
+    switch (format) {
+        case MIRI_FORMAT_CS16:
+            state.scale = scale * MiriFormatTraits<MIRI_FORMAT_CS16>::fullScale;
+            if (!dcRemoval && !power && scale == 1.0f) {
+                return &miriConvertCopy;
+            }
+            return miriSelectConverter<MIRI_FORMAT_CS16>(dcRemoval, power);
+        case MIRI_FORMAT_CS8:
+            state.scale = scale * MiriFormatTraits<MIRI_FORMAT_CS8>::fullScale;
+            return miriSelectConverter<MIRI_FORMAT_CS8>(dcRemoval, power);
+        case MIRI_FORMAT_CF32:
+        default:
+            state.scale = scale * MiriFormatTraits<MIRI_FORMAT_CF32>::fullScale;
+            return miriSelectConverter<MIRI_FORMAT_CF32>(dcRemoval, power);
+    }
+}
+
+/*!
+ * Signal statistics of one ring buffer, all relative to full scale.
+ */
+struct MiriBufferStats {
+    float power = 0.0f; // mean I^2 + Q^2
+    float peak = 0.0f; // largest |I| or |Q|
+    float dcI = 0.0f;
+    float dcQ = 0.0f;
+    uint32_t clipped = 0; // I and Q components at or beyond the clip level
+};
+
+typedef void (*MiriIngestFn)(const void *in, int16_t *out, size_t numElems, int32_t clipLevel, MiriBufferStats *stats);
+
+typedef enum miriMeasure {
+    MIRI_MEASURE_NONE,
+    MIRI_MEASURE_POWER, // the squelch only needs the energy
+    MIRI_MEASURE_ALL,
+} miriMeasure;
+
+/*!
+ * Unpack a USB transfer into the ring's int16 layout (8-bit wire samples are scaled up to the
+ * int16 range) and, for the squelch and the stats, measure the buffer in the same pass.
+ * The accumulators are integers so the reductions vectorize without reassociation flags.
+ */
+template <typename WIRE, miriMeasure MEASURE>
+void miriIngest(const void *in, int16_t *out, size_t numElems, int32_t clipLevel, MiriBufferStats *stats) {
+    const auto *source = (const WIRE *) in;
+    const int shift = (sizeof(WIRE) == 1) ? 8 : 0;
+    int64_t sumI = 0, sumQ = 0, power = 0;
+    int32_t peak = 0;
+    uint32_t clipped = 0;
+
+    for (size_t i = 0; i < numElems; i++) {
+        const int32_t vi = (int16_t) (source[i * 2 + 0] * (1 << shift));
+        const int32_t vq = (int16_t) (source[i * 2 + 1] * (1 << shift));
+        if (MEASURE != MIRI_MEASURE_NONE) {
+            power += (int64_t) vi * vi + (int64_t) vq * vq;
+        }
+        if (MEASURE == MIRI_MEASURE_ALL) {
+            const int32_t ai = vi < 0 ? -vi : vi;
+            const int32_t aq = vq < 0 ? -vq : vq;
+            sumI += vi;
+            sumQ += vq;
+            peak = ai > peak ? ai : peak;
+            peak = aq > peak ? aq : peak;
+            clipped += (ai >= clipLevel) + (aq >= clipLevel);
+        }
+        out[i * 2 + 0] = (int16_t) vi;
+        out[i * 2 + 1] = (int16_t) vq;
+    }
+
+    if (MEASURE != MIRI_MEASURE_NONE && numElems != 0) {
+        stats->power = (float) ((double) power / numElems / (32768.0 * 32768.0));
+    }
+    if (MEASURE == MIRI_MEASURE_ALL && numElems != 0) {
+        stats->peak = (float) peak / 32768.0f;
+        stats->dcI = (float) ((double) sumI / numElems / 32768.0);
+        stats->dcQ = (float) ((double) sumQ / numElems / 32768.0);
+        stats->clipped = clipped;
+    }
+}
+
+template <typename WIRE>
+MiriIngestFn miriSelectIngest(miriMeasure measure) {
+    switch (measure) {
+        case MIRI_MEASURE_POWER: return &miriIngest<WIRE, MIRI_MEASURE_POWER>;
+        case MIRI_MEASURE_ALL: return &miriIngest<WIRE, MIRI_MEASURE_ALL>;
+        default: return &miriIngest<WIRE, MIRI_MEASURE_NONE>;
+    }
+}
+
+inline MiriIngestFn miriSelectIngest(size_t wireBytesPerSample, miriMeasure measure) {
+    if (wireBytesPerSample == 1) {
+        return miriSelectIngest<int8_t>(measure);
+    }
+    return miriSelectIngest<int16_t>(measure);
+}
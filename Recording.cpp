@@ -0,0 +1,476 @@
+#include "Recording.hpp"
+#include <SoapySDR/Logger.h>
+#include <SoapySDR/Types.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static const char FILE_MAGIC[8] = {'M', 'I', 'R', 'I', 'I', 'Q', '0', '1'};
+static const char INDEX_MAGIC[8] = {'M', 'I', 'R', 'I', 'I', 'D', 'X', '1'};
+
+// queued ring buffers before push() starts dropping blocks
+static const size_t MAX_QUEUED_BLOCKS = 64;
+
+// unary prefixes this long are followed by the raw value instead
+static const unsigned RICE_ESCAPE = 32;
+static const unsigned RICE_RAW_BITS = 17;
+
+/*******************************************************************
+ * Block codec
+ ******************************************************************/
+
+namespace {
+
+struct BitWriter {
+    std::vector<uint8_t> &out;
+    uint64_t acc = 0;
+    unsigned count = 0;
+
+    explicit BitWriter(std::vector<uint8_t> &out) : out(out) {}
+
+    // bits <= 32, value already masked
+    inline void put(uint32_t value, unsigned bits) {
+        acc |= (uint64_t) value << count;
+        count += bits;
+        while (count >= 8) {
+            out.push_back((uint8_t) acc);
+            acc >>= 8;
+            count -= 8;
+        }
+    }
+
+    void flush(void) {
+        if (count != 0) {
+            out.push_back((uint8_t) acc);
+        }
+        acc = 0;
+        count = 0;
+    }
+};
+
+struct BitReader {
+    const uint8_t *pos;
+    const uint8_t *end;
+    uint64_t acc = 0;
+    unsigned count = 0;
+    bool overrun = false;
+
+    BitReader(const uint8_t *data, size_t size) : pos(data), end(data + size) {}
+
+    inline uint32_t get(unsigned bits) {
+        while (count < bits) {
+            if (pos == end) {
+                overrun = true;
+            } else {
+                acc |= (uint64_t) *pos++ << count;
+            }
+            count += 8;
+        }
+        const uint32_t value = (uint32_t) (acc & ((1ull << bits) - 1));
+        acc >>= bits;
+        count -= bits;
+        return value;
+    }
+
+    // unary prefix: counts the ones up to the terminating zero (consumed), or limit ones (< 64)
+    inline unsigned ones(unsigned limit) {
+        while (count <= limit) {
+            if (pos == end) {
+                overrun = count == 0;
+                break;
+            }
+            acc |= (uint64_t) *pos++ << count;
+            count += 8;
+        }
+        unsigned q = 0;
+        while (q < limit && ((acc >> q) & 1) != 0) {
+            q++;
+        }
+        const unsigned used = std::min(q < limit ? q + 1 : q, count);
+        acc >>= used;
+        count -= used;
+        return q;
+    }
+};
+
+unsigned bitLength(uint32_t value) {
+    unsigned bits = 0;
+    while (value != 0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+}
+
+void miriEncodeBlock(
+        miriRecordCodec codec,
+        const int16_t *in,
+        size_t numElems,
+        MiriBlockHeader &header,
+        std::vector<uint8_t> &payload) {
+    const size_t numValues = numElems * 2;
+    std::memset(&header, 0, sizeof(header));
+    header.numElems = (uint32_t) numElems;
+    header.codec = (uint8_t) codec;
+    payload.clear();
+
+    // ADCs narrower than 16 bits leave the low bits of every sample empty
+    uint32_t used = 0;
+    for (size_t i = 0; i < numValues; i++) {
+        used |= (uint16_t) in[i];
+    }
+    unsigned shift = 0;
+    while (used != 0 && (used & (1u << shift)) == 0) {
+        shift++;
+    }
+    header.shift = (uint8_t) shift;
+
+    BitWriter writer(payload);
+    if (codec == MIRI_CODEC_PACK) {
+        // two's complement at the narrowest width holding every sample of the block
+        uint32_t magnitude = 0;
+        for (size_t i = 0; i < numValues; i++) {
+            const int32_t v = in[i] >> shift;
+            magnitude |= (uint32_t) (v ^ (v >> 31));
+        }
+        const unsigned bits = bitLength(magnitude) + 1;
+        const uint32_t mask = (uint32_t) ((1ull << bits) - 1);
+        header.param = (uint8_t) bits;
+        payload.reserve(numValues * bits / 8 + 1);
+        for (size_t i = 0; i < numValues; i++) {
+            writer.put((uint32_t) (in[i] >> shift) & mask, bits);
+        }
+    } else {
+        // I and Q are predicted from their previous sample, the zigzagged residuals are Rice coded
+        std::vector<uint32_t> residuals(numValues);
+        uint64_t sum = 0;
+        int32_t prev[2] = {0, 0};
+        for (size_t i = 0; i < numValues; i++) {
+            const int32_t v = in[i] >> shift;
+            const int32_t d = v - prev[i & 1];
+            prev[i & 1] = v;
+            residuals[i] = ((uint32_t) d << 1) ^ (uint32_t) (d >> 31);
+            sum += residuals[i];
+        }
+        const unsigned k = numValues == 0 ? 0 : (unsigned) std::max(0, (int) bitLength((uint32_t) (sum / numValues)) - 1);
+        const uint32_t mask = (1u << k) - 1;
+        header.param = (uint8_t) k;
+        payload.reserve(numValues * (k + 2) / 8 + 1);
+        for (size_t i = 0; i < numValues; i++) {
+            const uint32_t q = residuals[i] >> k;
+            if (q < RICE_ESCAPE) {
+                writer.put((uint32_t) ((1ull << q) - 1), q);
+                writer.put(0, 1);
+                writer.put(residuals[i] & mask, k);
+            } else {
+                writer.put(0xffffffffu, RICE_ESCAPE);
+                writer.put(residuals[i], RICE_RAW_BITS);
+            }
+        }
+    }
+    writer.flush();
+    header.payloadBytes = (uint32_t) payload.size();
+}
+
+bool miriDecodeBlock(const MiriBlockHeader &header, const uint8_t *payload, int16_t *out) {
+    const size_t numValues = (size_t) header.numElems * 2;
+    const unsigned shift = header.shift;
+    BitReader reader(payload, header.payloadBytes);
+
+    if (header.codec == MIRI_CODEC_PACK) {
+        const unsigned bits = header.param;
+        if (bits == 0 || bits > 16) {
+            return false;
+        }
+        const int32_t sign = 1 << (bits - 1);
+        for (size_t i = 0; i < numValues; i++) {
+            const int32_t v = ((int32_t) reader.get(bits) ^ sign) - sign;
+            out[i] = (int16_t) (v * (1 << shift));
+        }
+    } else if (header.codec == MIRI_CODEC_RICE) {
+        const unsigned k = header.param;
+        if (k > 16) {
+            return false;
+        }
+        int32_t prev[2] = {0, 0};
+        for (size_t i = 0; i < numValues; i++) {
+            const unsigned q = reader.ones(RICE_ESCAPE);
+            const uint32_t z = (q < RICE_ESCAPE) ? ((q << k) | reader.get(k)) : reader.get(RICE_RAW_BITS);
+            const int32_t d = (int32_t) (z >> 1) ^ -(int32_t) (z & 1);
+            prev[i & 1] += d;
+            out[i] = (int16_t) (prev[i & 1] * (1 << shift));
+            if (reader.overrun) {
+                return false;
+            }
+        }
+    } else {
+        return false;
+    }
+
+    return !reader.overrun;
+}
+
+/*******************************************************************
+ * Recorder
+ ******************************************************************/
+
+MiriRecorder::MiriRecorder(
+        const std::string &path,
+        miriRecordCodec codec,
+        double sampleRate,
+        double frequency,
+        size_t numThreads) :
+        _codec(codec),
+        _nextSeq(0),
+        _stop(false),
+        _writeSeq(0),
+        _offset(0),
+        _blocks(0),
+        _droppedBlocks(0),
+        _rawBytes(0),
+        _codedBytes(0),
+        _writeError(false) {
+    _file = std::fopen(path.c_str(), "wb");
+    if (_file == nullptr) {
+        throw std::runtime_error("MiriRecorder: cannot open '" + path + "'");
+    }
+
+    MiriFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.sampleRate = sampleRate;
+    header.frequency = frequency;
+    header.codec = (uint32_t) codec;
+    std::fwrite(&header, sizeof(header), 1, _file);
+    _offset = sizeof(header);
+
+    numThreads = std::max<size_t>(1, numThreads);
+    for (size_t i = 0; i < numThreads; i++) {
+        _workers.emplace_back(&MiriRecorder::workerOperation, this);
+    }
+}
+
+MiriRecorder::~MiriRecorder(void) {
+    {
+        std::lock_guard<std::mutex> lock(_jobMutex);
+        _stop = true;
+    }
+    _jobCond.notify_all();
+    for (auto &worker : _workers) {
+        worker.join();
+    }
+
+    // the index goes last, so a recording cut short is still readable up to its last block
+    MiriFileFooter footer;
+    std::memcpy(footer.magic, INDEX_MAGIC, sizeof(footer.magic));
+    footer.indexOffset = _offset;
+    footer.numBlocks = _index.size();
+    for (const auto &entry : _index) {
+        const uint64_t record[2] = {entry.first, entry.second};
+        std::fwrite(record, sizeof(record), 1, _file);
+    }
+    std::fwrite(&footer, sizeof(footer), 1, _file);
+
+    if (std::fclose(_file) != 0 || _writeError) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "MiriRecorder: write error, the recording is incomplete");
+    }
+}
+
+bool MiriRecorder::push(unsigned long long tick, const void *wire, size_t numElems, MiriIngestFn ingest) {
+    Job job;
+    {
+        std::lock_guard<std::mutex> lock(_jobMutex);
+        if (_jobs.size() >= MAX_QUEUED_BLOCKS) {
+            _droppedBlocks++;
+            return false;
+        }
+        if (!_pool.empty()) {
+            job.samples = std::move(_pool.back());
+            _pool.pop_back();
+        }
+        job.seq = _nextSeq++;
+    }
+
+    // the copy runs outside the lock, the workers keep encoding meanwhile
+    job.tick = tick;
+    job.numElems = numElems;
+    job.samples.resize(numElems * 2);
+    ingest(wire, job.samples.data(), numElems, 0, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(_jobMutex);
+        _jobs.push_back(std::move(job));
+    }
+    _jobCond.notify_one();
+    return true;
+}
+
+void MiriRecorder::workerOperation(void) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_jobMutex);
+            _jobCond.wait(lock, [this] { return _stop || !_jobs.empty(); });
+            if (_jobs.empty()) {
+                return;
+            }
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+
+        Encoded block;
+        miriEncodeBlock(_codec, job.samples.data(), job.numElems, block.header, block.payload);
+        block.header.tick = job.tick;
+
+        {
+            std::lock_guard<std::mutex> lock(_jobMutex);
+            _pool.push_back(std::move(job.samples));
+        }
+
+        // whoever completes the next block in sequence writes out everything that's ready
+        std::lock_guard<std::mutex> lock(_writeMutex);
+        _done.emplace(job.seq, std::move(block));
+        for (auto it = _done.find(_writeSeq); it != _done.end(); it = _done.find(_writeSeq)) {
+            writeBlock(it->second);
+            _done.erase(it);
+            _writeSeq++;
+        }
+    }
+}
+
+void MiriRecorder::writeBlock(const Encoded &block) {
+    // caller holds _writeMutex
+    _index.emplace_back(block.header.tick, _offset);
+    bool ok = std::fwrite(&block.header, sizeof(block.header), 1, _file) == 1;
+    if (!block.payload.empty()) {
+        ok &= std::fwrite(block.payload.data(), block.payload.size(), 1, _file) == 1;
+    }
+    if (!ok) {
+        _writeError = true;
+    }
+
+    _offset += sizeof(block.header) + block.payload.size();
+    _blocks++;
+    _rawBytes += (unsigned long long) block.header.numElems * 2 * sizeof(int16_t);
+    _codedBytes += sizeof(block.header) + block.payload.size();
+}
+
+std::string MiriRecorder::status(void) const {
+    SoapySDR::Kwargs status;
+    status["codec"] = (_codec == MIRI_CODEC_RICE) ? "rice" : "pack";
+    status["blocks"] = std::to_string(_blocks.load());
+    status["dropped_blocks"] = std::to_string(_droppedBlocks.load());
+    status["raw_bytes"] = std::to_string(_rawBytes.load());
+    status["coded_bytes"] = std::to_string(_codedBytes.load());
+    status["error"] = _writeError ? "true" : "false";
+    return SoapySDR::KwargsToString(status);
+}
+
+/*******************************************************************
+ * Replay
+ ******************************************************************/
+
+// std::fseek takes a long, which is 32 bits on Windows and 32-bit systems
+static int seekFile(std::FILE *file, int64_t offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, whence);
+#else
+    return fseeko(file, (off_t) offset, whence);
+#endif
+}
+
+MiriReplay::MiriReplay(const std::string &path) {
+    _file = std::fopen(path.c_str(), "rb");
+    if (_file == nullptr) {
+        throw std::runtime_error("MiriReplay: cannot open '" + path + "'");
+    }
+    if (std::fread(&_header, sizeof(_header), 1, _file) != 1 ||
+        std::memcmp(_header.magic, FILE_MAGIC, sizeof(_header.magic)) != 0) {
+        std::fclose(_file);
+        throw std::runtime_error("MiriReplay: '" + path + "' is not a MiriSDR recording");
+    }
+
+    // the index written when the recording was closed
+    MiriFileFooter footer;
+    if (seekFile(_file, -(int64_t) sizeof(footer), SEEK_END) == 0 &&
+        std::fread(&footer, sizeof(footer), 1, _file) == 1 &&
+        std::memcmp(footer.magic, INDEX_MAGIC, sizeof(footer.magic)) == 0 &&
+        seekFile(_file, (int64_t) footer.indexOffset, SEEK_SET) == 0) {
+        _index.resize(footer.numBlocks);
+        for (auto &entry : _index) {
+            uint64_t record[2];
+            if (std::fread(record, sizeof(record), 1, _file) != 1) {
+                _index.clear();
+                break;
+            }
+            entry = std::make_pair(record[0], record[1]);
+        }
+    }
+
+    // no (intact) index: walk the block headers
+    if (_index.empty()) {
+        uint64_t offset = sizeof(_header);
+        MiriBlockHeader block;
+        while (seekFile(_file, (int64_t) offset, SEEK_SET) == 0 &&
+               std::fread(&block, sizeof(block), 1, _file) == 1 &&
+               block.codec <= MIRI_CODEC_RICE &&
+               block.payloadBytes <= (uint64_t) block.numElems * 2 * 4 + 8) {
+            _index.emplace_back(block.tick, offset);
+            offset += sizeof(block) + block.payloadBytes;
+        }
+        SoapySDR_logf(SOAPY_SDR_WARNING, "MiriReplay: '%s' has no index, found %zu blocks", path.c_str(), _index.size());
+    }
+}
+
+MiriReplay::~MiriReplay(void) {
+    std::fclose(_file);
+}
+
+double MiriReplay::sampleRate(void) const {
+    return _header.sampleRate;
+}
+
+double MiriReplay::frequency(void) const {
+    return _header.frequency;
+}
+
+size_t MiriReplay::numBlocks(void) const {
+    return _index.size();
+}
+
+size_t MiriReplay::findBlock(unsigned long long tick) const {
+    if (_index.empty()) {
+        return 0;
+    }
+    const uint64_t target = _index.front().first + tick;
+    auto it = std::upper_bound(_index.begin(), _index.end(), std::make_pair(target, UINT64_MAX));
+    return it == _index.begin() ? 0 : (size_t) (it - _index.begin()) - 1;
+}
+
+size_t MiriReplay::readBlock(size_t block, std::vector<int16_t> &samples, unsigned long long &tick) {
+    if (block >= _index.size()) {
+        return 0;
+    }
+
+    MiriBlockHeader header;
+    if (seekFile(_file, (int64_t) _index[block].second, SEEK_SET) != 0 ||
+        std::fread(&header, sizeof(header), 1, _file) != 1) {
+        return 0;
+    }
+    _payload.resize(header.payloadBytes);
+    if (header.payloadBytes != 0 && std::fread(_payload.data(), header.payloadBytes, 1, _file) != 1) {
+        return 0;
+    }
+
+    samples.resize((size_t) header.numElems * 2);
+    if (!miriDecodeBlock(header, _payload.data(), samples.data())) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "MiriReplay: block %zu is damaged", block);
+        return 0;
+    }
+
+    // relative to the start of the recording, like the stream timestamps
+    tick = header.tick - _index.front().first;
+    return header.numElems;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "Conversion.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef enum miriRecordCodec {
+    MIRI_CODEC_PACK, // bit packing only, minimum CPU
+    MIRI_CODEC_RICE, // bit packing plus delta and Rice coding
+} miriRecordCodec;
+
+/*!
+ * Recording file layout (little endian):
+ * file header, then one block header + payload per ring buffer, then the block index
+ * (tick and file offset of every block) and the footer pointing at it. A recording that
+ * wasn't closed has no index; the reader then rebuilds it from the block headers.
+ */
+struct MiriFileHeader {
+    char magic[8]; // "MIRIIQ01"
+    double sampleRate;
+    double frequency;
+    uint32_t codec;
+    uint32_t reserved;
+};
+
+/*!
+ * Every block is coded on its own, so any block can be decoded without its predecessors.
+ * Samples are stored right-shifted by the block's common trailing zero bits; param is the
+ * packed width for PACK and the Rice parameter for RICE.
+ */
+struct MiriBlockHeader {
+    uint64_t tick;
+    uint32_t numElems;
+    uint32_t payloadBytes;
+    uint8_t codec;
+    uint8_t shift;
+    uint8_t param;
+    uint8_t reserved[5];
+};
+
+struct MiriFileFooter {
+    uint64_t indexOffset;
+    uint64_t numBlocks;
+    char magic[8]; // "MIRIIDX1"
+};
+
+void miriEncodeBlock(
+        miriRecordCodec codec,
+        const int16_t *in,
+        size_t numElems,
+        MiriBlockHeader &header,
+        std::vector<uint8_t> &payload);
+
+bool miriDecodeBlock(const MiriBlockHeader &header, const uint8_t *payload, int16_t *out);
+
+/*!
+ * Encodes ring buffers on a pool of worker threads and writes them in order.
+ * push() only copies the samples into a queued job, so it's cheap enough for the rx thread;
+ * when the encoder falls behind, whole blocks are dropped and show up as gaps in the ticks.
+ */
+class MiriRecorder {
+public:
+    MiriRecorder(
+            const std::string &path,
+            miriRecordCodec codec,
+            double sampleRate,
+            double frequency,
+            size_t numThreads);
+
+    // drains the queue and writes the index
+    ~MiriRecorder(void);
+
+    bool push(unsigned long long tick, const void *wire, size_t numElems, MiriIngestFn ingest);
+
+    std::string status(void) const;
+
+private:
+    struct Job {
+        uint64_t seq;
+        unsigned long long tick;
+        size_t numElems;
+        std::vector<int16_t> samples;
+    };
+
+    struct Encoded {
+        MiriBlockHeader header;
+        std::vector<uint8_t> payload;
+    };
+
+    void workerOperation(void);
+
+    void writeBlock(const Encoded &block);
+
+    std::FILE *_file;
+    miriRecordCodec _codec;
+    std::vector<std::thread> _workers;
+
+    // job queue, filled by push()
+    std::mutex _jobMutex;
+    std::condition_variable _jobCond;
+    std::deque<Job> _jobs;
+    std::vector<std::vector<int16_t>> _pool;
+    uint64_t _nextSeq;
+    bool _stop;
+
+    // in-order writer, the workers take turns under _writeMutex
+    std::mutex _writeMutex;
+    std::map<uint64_t, Encoded> _done;
+    uint64_t _writeSeq;
+    uint64_t _offset;
+    std::vector<std::pair<uint64_t, uint64_t>> _index;
+
+    std::atomic<unsigned long long> _blocks;
+    std::atomic<unsigned long long> _droppedBlocks;
+    std::atomic<unsigned long long> _rawBytes;
+    std::atomic<unsigned long long> _codedBytes;
+    std::atomic<bool> _writeError;
+};
+
+/*!
+ * Random access reader for recordings, used by the replay device.
+ */
+class MiriReplay {
+public:
+    explicit MiriReplay(const std::string &path);
+
+    ~MiriReplay(void);
+
+    double sampleRate(void) const;
+
+    double frequency(void) const;
+
+    size_t numBlocks(void) const;
+
+    // index of the block holding the given tick (relative to the first block)
+    size_t findBlock(unsigned long long tick) const;
+
+    // decodes one block, returns its number of samples (0 past the end or on a damaged block)
+    size_t readBlock(size_t block, std::vector<int16_t> &samples, unsigned long long &tick);
+
+private:
+    std::FILE *_file;
+    MiriFileHeader _header;
+    std::vector<std::pair<uint64_t, uint64_t>> _index;
+    std::vector<uint8_t> _payload;
+};
@@ -1,9 +1,51 @@
 #include "SoapyMiri.hpp"
+#include "SoapyMiriAggregate.hpp"
 #include <SoapySDR/Registry.hpp>
 
 std::vector<SoapySDR::Kwargs> SoapyMiri::findMiriSDR(const SoapySDR::Kwargs &args) {
     std::vector<SoapySDR::Kwargs> results;
 
+    // recording in place of a dongle, see the 'record' setting
+    if (args.count("replay") != 0) {
+        SoapySDR::Kwargs devInfo;
+        devInfo["label"] = "MiriSDR replay :: " + args.at("replay");
+        devInfo["replay"] = args.at("replay");
+        results.push_back(devInfo);
+        return results;
+    }
+
+    // aggregate of several dongles, only offered when all of them are present
+    // (or simulated: the serials only name the channels then)
+    const bool simulated = args.count("simulate") != 0 && args.at("simulate") != "false";
+    if (args.count("serials") != 0) {
+        const auto serials = SoapyMiriAggregate::parseSerials(args.at("serials"));
+        for (const auto &serial : serials) {
+            SoapySDR::Kwargs query;
+            query["serial"] = serial;
+            if (!simulated && findMiriSDR(query).empty()) {
+                return results;
+            }
+        }
+
+        SoapySDR::Kwargs devInfo;
+        devInfo["label"] = "MiriSDR aggregate :: " + args.at("serials");
+        devInfo["serials"] = args.at("serials");
+        if (simulated) {
+            devInfo["simulate"] = args.at("simulate");
+        }
+        results.push_back(devInfo);
+        return results;
+    }
+
+    // synthetic transfers, no hardware needed
+    if (simulated) {
+        SoapySDR::Kwargs devInfo;
+        devInfo["label"] = "MiriSDR simulated";
+        devInfo["simulate"] = args.at("simulate");
+        results.push_back(devInfo);
+        return results;
+    }
+
     char manufact[256], product[256], serial[256];
 
     const size_t this_count = mirisdr_get_device_count();
@@ -38,6 +80,9 @@ std::vector<SoapySDR::Kwargs> SoapyMiri::findMiriSDR(const SoapySDR::Kwargs &arg
 }
 
 static SoapySDR::Device *makeMiriSDR(const SoapySDR::Kwargs &args) {
+    if (args.count("serials") != 0) {
+        return new SoapyMiriAggregate(args);
+    }
     return new SoapyMiri(args);
 }
 
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+/*!
+ * Sequence lock around a small trivially copyable value.
+ * Readers never block or take a lock: they copy the value word by word and retry if a write
+ * overlapped the copy. Writers are serialized by a mutex and only bump the sequence around
+ * the copy, so pollers on other threads can't slow down a setter either.
+ */
+template <typename T>
+class MiriSeqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "MiriSeqlock needs a trivially copyable value");
+
+public:
+    MiriSeqlock(void) : _seq(0) {
+        for (auto &word : _words) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        this->write(T());
+    }
+
+    T load(void) const {
+        uint64_t copy[WORDS];
+        while (true) {
+            const unsigned seq = _seq.load(std::memory_order_acquire);
+            if ((seq & 1) != 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < WORDS; i++) {
+                copy[i] = _words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (_seq.load(std::memory_order_relaxed) == seq) {
+                break;
+            }
+        }
+
+        T value;
+        std::memcpy(&value, copy, sizeof(T));
+        return value;
+    }
+
+    // read-modify-write, e.g. update([](State &s) { s.x = 1; })
+    template <typename F>
+    void update(F modify) {
+        std::lock_guard<std::mutex> lock(_writeMutex);
+        T value = this->load();
+        modify(value);
+        this->write(value);
+    }
+
+private:
+    static const size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    void write(const T &value) {
+        uint64_t copy[WORDS] = {};
+        std::memcpy(copy, &value, sizeof(T));
+
+        const unsigned seq = _seq.load(std::memory_order_relaxed);
+        _seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; i++) {
+            _words[i].store(copy[i], std::memory_order_relaxed);
+        }
+        _seq.store(seq + 2, std::memory_order_release);
+    }
+
+    std::atomic<unsigned> _seq;
+    std::atomic<uint64_t> _words[WORDS];
+    std::mutex _writeMutex;
+};
@@ -1,4 +1,15 @@
 #include "SoapyMiri.hpp"
+#include <algorithm>
+#include <cmath>
+
+// maximum rates as picked by libmirisdr when the format is set to AUTO
+static const MiriWireFormat wireFormats[] = {
+    {"252_S16", 2, 14, 6048000},
+    {"336_S16", 2, 12, 8064000},
+    {"384_S16", 2, 10, 9216000},
+    {"504_S16", 2, 8, 12096000},
+    {"504_S8", 1, 8, 12096000},
+};
 
 /*******************************************************************
  * Identification API
@@ -6,27 +17,139 @@
 
 SoapyMiri::SoapyMiri(const SoapySDR::Kwargs &args) :
         dev(nullptr),
+        sampleRate(0),
         remainingElems(0),
-        resetBuffer(false) {
+        _powerSum(0),
+        _powerCount(0),
+        _sampleTick(0),
+        _nextTickValid(false),
+        resetBuffer(false),
+        _droppedSamples(0),
+        _lossIndex(0),
+        _lossElems(0),
+        _lastLossIndex(0),
+        _lastLossElems(0) {
     if (args.count("label") != 0) {
         SoapySDR_logf(SOAPY_SDR_INFO, "Opening %s...", args.at("label").c_str());
     }
 
-    if (args.count("index") == 0) {
-        throw std::runtime_error("No SDRplay devices supported by LibMiriSDR found!");
-    }
+    channelizerBins = 0;
+    optBufferLength = DEFAULT_BUFFER_LENGTH;
+    optNumBuffers = DEFAULT_NUM_BUFFERS;
+    _discardBefore = 0;
+    _cleanIndex = 0;
+    _burstActive = false;
+    _burstStopped = false;
+    _activateTick = 0;
+    _historyElems = 0;
+    _historyWrite = 0;
+    _historyMaxWrite = 0;
+    _snapshotState = MIRI_TRIGGER_IDLE;
+    _snapshotGeneration = 0;
+    _snapshotTick = 0;
+    _snapshotElems = 0;
+    _snapshotAbort = false;
+    _rxRunning = false;
+    _paused = true;
+    _firstSamplePending = false;
+    _activateLatencyUs = -1;
+    optLatency = false;
+    optStats = false;
+    optStatsWindowElems = 1;
+    _clipLevel = 32767;
+    _wireBytesPerSample = BYTES_PER_SAMPLE;
+    _binsChanged = false;
+    _statsAccum = MiriStatsWindow();
+    _burstStatsNext = 0;
+    _rxConvertFormat = false;
+    _rxConvert = false;
+    _segmentElems = 0;
+    _currentOffset = 0;
+    _latencyNext = 0;
+    _replayStop = false;
+    _replayBlock = 0;
+    _simulated = false;
+    _simulateCounter = false;
+    _simulateMarker = false;
+    _simulateDrop = 0;
+
+    if (args.count("replay") != 0) {
+        // a recording stands in for the dongle, the hardware settings are unavailable
+        _replay.reset(new MiriReplay(args.at("replay")));
+        deviceIdx = 0;
+        sampleRate = _replay->sampleRate();
+    } else if (args.count("simulate") != 0 && args.at("simulate") != "false") {
+        // synthetic transfers paced like a dongle's, for benchmarks and tests without hardware
+        _simulated = true;
+        _simulateCounter = (args.at("simulate") == "counter");
+        _simulateMarker = (args.at("simulate") == "marker");
+        deviceIdx = 0;
+        sampleRate = DEFAULT_SIMULATED_RATE;
+    } else {
+        if (args.count("index") == 0) {
+            throw std::runtime_error("No SDRplay devices supported by LibMiriSDR found!");
+        }
 
-    // TODO: This probably needs to be implemented in the API (like in `rtlsdr_get_index_by_serial`).
-    // For now, we're fine with passing indices in the Kwargs.
-    deviceIdx = (uint32_t) std::stoi(args.at("index"));
+        // TODO: This probably needs to be implemented in the API (like in `rtlsdr_get_index_by_serial`).
+        // For now, we're fine with passing indices in the Kwargs.
+        deviceIdx = (uint32_t) std::stoi(args.at("index"));
+
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "LibMiriSDR opening device %d", deviceIdx);
+        if (mirisdr_open(&dev, deviceIdx) != 0) {
+            throw std::runtime_error("Unable to open LibMiriSDR device.");
+        }
 
-    SoapySDR_logf(SOAPY_SDR_DEBUG, "LibMiriSDR opening device %d", deviceIdx);
-    if (mirisdr_open(&dev, deviceIdx) != 0) {
-        throw std::runtime_error("Unable to open LibMiriSDR device.");
+        sampleRate = (double) mirisdr_get_sample_rate(dev);
+        isOffsetTuning = false;
+
+        if (args.count("sample_format") != 0) {
+            writeSetting("sample_format", args.at("sample_format"));
+        }
+    }
+    if (args.count("channels") != 0) {
+        writeSetting("channelizer", args.at("channels"));
+    }
+    if (args.count("channel_offsets") != 0) {
+        writeSetting("channel_offsets", args.at("channel_offsets"));
     }
+
+    cacheState();
+}
+
+void SoapyMiri::cacheState(void) {
+    _state.update([this](MiriSettingsState &state) {
+        state.sampleRate = sampleRate;
+        if (!dev) {
+            state.frequency = _replay ? _replay->frequency() : 0;
+            return;
+        }
+
+        // `mirisdr_get_tuner_gains` writes many integers into the `int* gains` parameter.
+        // This is a bit ridiculous. So we'll just get the highest value and assume 0 as the lowest.
+        if (state.tunerGainMax == 0) {
+            state.tunerGainMax = mirisdr_get_tuner_gains(dev, nullptr);
+        }
+        state.frequency = (double) mirisdr_get_center_freq(dev);
+        state.bandwidth = (double) mirisdr_get_bandwidth(dev);
+        state.gainMode = (bool) mirisdr_get_tuner_gain_mode(dev);
+        state.tunerGain = (double) mirisdr_get_tuner_gain(dev);
+        state.lnaGain = mirisdr_get_lna_gain(dev) > 0 ? 1.0 : 0.0; // returns 0 or 24, clamp it to the gain's range (0-1)
+        state.basebandGain = (double) mirisdr_get_baseband_gain(dev);
+        state.mixerGain = (double) mirisdr_get_mixer_gain(dev);
+        state.mixbufferGain = (double) mirisdr_get_mixbuffer_gain(dev);
+        state.flavour = (int) hwFlavour;
+        state.biasTee = mirisdr_get_bias(dev) != 0;
+        state.offsetTuning = isOffsetTuning;
+    });
 }
 
 SoapyMiri::~SoapyMiri(void) {
+    _snapshotAbort = true;
+    if (_snapshotThread.joinable()) {
+        _snapshotThread.join();
+    }
+
+    stopRxThread();
     if (dev) {
         mirisdr_close(dev);
     }
@@ -59,7 +182,39 @@ SoapySDR::Kwargs SoapyMiri::getHardwareInfo(void) const {
  ******************************************************************/
 
 size_t SoapyMiri::getNumChannels(const int dir) const {
-    return (dir == SOAPY_SDR_RX) ? 1 : 0;
+    if (dir != SOAPY_SDR_RX) {
+        return 0;
+    }
+    if (channelizerBins == 0) {
+        return 1;
+    }
+    return channelOffsets.empty() ? channelizerBins : channelOffsets.size();
+}
+
+size_t SoapyMiri::channelBin(const size_t channel) const {
+    // user-listed offsets snap to the nearest bin
+    if (!channelOffsets.empty()) {
+        const long long n = (long long) channelizerBins;
+        const long long bin = std::llround(channelOffsets.at(channel) * n / sampleRate);
+        return (size_t) (((bin % n) + n) % n);
+    }
+    // otherwise in ascending frequency: channel 0 is the lowest bin
+    return (channel + channelizerBins / 2) % channelizerBins;
+}
+
+void SoapyMiri::updateChannelBins(void) {
+    // the offsets land in other bins after a rate change, the reader picks up the new selection
+    // before its next block
+    if (!_channelizer) {
+        return;
+    }
+    std::vector<size_t> bins;
+    for (const auto channel : _streamChannels) {
+        bins.push_back(channelBin(channel));
+    }
+    std::lock_guard<std::mutex> lock(_binsMutex);
+    _pendingBins = bins;
+    _binsChanged = true;
 }
 
 bool SoapyMiri::getFullDuplex(const int direction, const size_t channel) const {
@@ -133,13 +288,11 @@ void SoapyMiri::setGainMode(const int direction, const size_t channel, const boo
     if (mirisdr_set_tuner_gain_mode(dev, automatic ? 0 : 1) != 0) {
         throw std::runtime_error("mirisdr_set_tuner_gain_mode failed");
     }
+    cacheState();
 }
 
 bool SoapyMiri::getGainMode(const int direction, const size_t channel) const {
-    if (!dev)
-        return false;
-
-    return (bool) mirisdr_get_tuner_gain_mode(dev);
+    return _state.load().gainMode;
 }
 
 void SoapyMiri::setGain(const int direction, const size_t channel, const double value) {
@@ -165,38 +318,31 @@ void SoapyMiri::setGain(const int direction, const size_t channel, const std::st
         mirisdr_set_mixbuffer_gain(dev, (int) value);
     } else {
         SoapySDR_logf(SOAPY_SDR_WARNING, "Trying to set non-existent gain '%s' to %f!", name.c_str(), value);
+        return;
     }
+    cacheState();
 }
 
 double SoapyMiri::getGain(const int direction, const size_t channel, const std::string &name) const {
-    if (!dev)
-        return 0.0;
-
+    const MiriSettingsState state = _state.load();
     if (name == "Automatic") {
-        return ((double) mirisdr_get_tuner_gain(dev));
+        return state.tunerGain;
     } else if (name == "LNA") {
-        return mirisdr_get_lna_gain(dev) > 0 ? 1.0 : 0.0; // returns 0 or 24, clamp it to the gain's range (0-1)
+        return state.lnaGain;
     } else if (name == "Baseband") {
-        return ((double) mirisdr_get_baseband_gain(dev));
+        return state.basebandGain;
     } else if (name == "Mixer") {
-        return ((double) mirisdr_get_mixer_gain(dev));
+        return state.mixerGain;
     } else if (name == "Mixbuffer") {
-        return ((double) mirisdr_get_mixbuffer_gain(dev));
+        return state.mixbufferGain;
     }
 
     return 0.0;
 }
 
 SoapySDR::Range SoapyMiri::getGainRange(const int direction, const size_t channel, const std::string &name) const {
-    if (!dev)
-        return {};
-
-    // `mirisdr_get_tuner_gains` writes many integers into the `int* gains` parameter.
-    // This is a bit ridiculous. So we'll just get the highest value and assume 0 as the lowest.
-    static int highest = mirisdr_get_tuner_gains(dev, nullptr);
-
     if (name == "Automatic") {
-        return {0, static_cast<double>(highest), 1};
+        return {0, static_cast<double>(_state.load().tunerGainMax), 1};
     } else if (name == "LNA") {
         return {0, 1, 1}; // 24 dB
     } else if (name == "Baseband") {
@@ -226,20 +372,34 @@ void SoapyMiri::setFrequency(
     if (!dev)
         return;
 
+    // extra arguments turn the retune into one transaction, see applySettings
+    if (name == "RF" && !args.empty()) {
+        SoapySDR::Kwargs transaction = args;
+        transaction["rf"] = std::to_string(frequency);
+        applySettings(transaction);
+        return;
+    }
+
     if (name == "RF") {
         SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting center freq: %d", (uint32_t) frequency);
+        MIRI_TRACE(EVENT_RETUNE, frequency);
         if (mirisdr_set_center_freq(dev, (uint32_t) frequency) != 0) {
             throw std::runtime_error("mirisdr_set_center_freq failed");
         }
+        cacheState();
     }
 }
 
 double SoapyMiri::getFrequency(const int direction, const size_t channel, const std::string &name) const {
-    if (!dev)
-        return 0;
-
     if (name == "RF") {
-        return (double) mirisdr_get_center_freq(dev);
+        double frequency = _state.load().frequency;
+        if (channelizerBins != 0) {
+            // centre of the channelizer bin the channel maps to
+            const auto bin = (long long) channelBin(channel);
+            const long long n = (long long) channelizerBins;
+            frequency += (double) (bin < n / 2 ? bin : bin - n) * sampleRate / n;
+        }
+        return frequency;
     }
 
     return 0;
@@ -267,7 +427,39 @@ SoapySDR::RangeList SoapyMiri::getFrequencyRange(
 SoapySDR::ArgInfoList SoapyMiri::getFrequencyArgsInfo(const int direction, const size_t channel) const {
     SoapySDR::ArgInfoList freqArgs;
 
-    // TODO: frequency arguments
+    // everything passed along with the frequency is applied as a single transaction
+    SoapySDR::ArgInfo rateArg;
+    rateArg.key = "rate";
+    rateArg.name = "Sample rate";
+    rateArg.description = "Sample rate to apply together with the frequency";
+    rateArg.units = "Sps";
+    rateArg.type = SoapySDR::ArgInfo::FLOAT;
+    freqArgs.push_back(rateArg);
+
+    SoapySDR::ArgInfo bandwidthArg;
+    bandwidthArg.key = "bandwidth";
+    bandwidthArg.name = "Bandwidth";
+    bandwidthArg.description = "IF bandwidth to apply together with the frequency";
+    bandwidthArg.units = "Hz";
+    bandwidthArg.type = SoapySDR::ArgInfo::FLOAT;
+    freqArgs.push_back(bandwidthArg);
+
+    SoapySDR::ArgInfo gainModeArg;
+    gainModeArg.key = "gain_mode";
+    gainModeArg.name = "Automatic gain";
+    gainModeArg.description = "Gain mode to apply together with the frequency";
+    gainModeArg.type = SoapySDR::ArgInfo::BOOL;
+    freqArgs.push_back(gainModeArg);
+
+    for (const auto &gain : listGains(direction, channel)) {
+        SoapySDR::ArgInfo gainArg;
+        gainArg.key = gain;
+        gainArg.name = gain + " gain";
+        gainArg.description = "Gain stage value to apply together with the frequency";
+        gainArg.units = "dB";
+        gainArg.type = SoapySDR::ArgInfo::FLOAT;
+        freqArgs.push_back(gainArg);
+    }
 
     return freqArgs;
 }
@@ -277,24 +469,53 @@ SoapySDR::ArgInfoList SoapyMiri::getFrequencyArgsInfo(const int direction, const
  ******************************************************************/
 
 void SoapyMiri::setSampleRate(const int direction, const size_t channel, const double rate) {
+    if (_simulated) {
+        this->sampleRate = rate;
+        updateChannelBins();
+        cacheState();
+        return;
+    }
     if (!dev)
         return;
 
     SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting sample rate: %d", rate);
+    if (wireFormat != "AUTO" && rate > getWireFormat().maxRate) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "Sample rate %.0f is above what the %s sample format carries (%.0f)",
+                      rate, wireFormat.c_str(), getWireFormat().maxRate);
+    }
     if (mirisdr_set_sample_rate(dev, (uint32_t) rate) != 0) {
         throw std::runtime_error("mirisdr_set_sample_rate failed");
     }
 
     auto newSampleRate = (double) mirisdr_get_sample_rate(dev);
     this->sampleRate = newSampleRate;
+    updateChannelBins();
+    if (wireFormat == "AUTO") {
+        // AUTO repacks by rate, a running stream clips at the new format's top code
+        std::lock_guard<std::mutex> rxLock(_rx_mutex);
+        _clipLevel = wireClipLevel();
+    }
+    cacheState();
 }
 
 double SoapyMiri::getSampleRate(const int direction, const size_t channel) const {
-    if (!dev)
-        return 0;
+    return _state.load().sampleRate;
+}
 
-    // return (double) mirisdr_get_sample_rate(dev);
-    return sampleRate;
+const MiriWireFormat &SoapyMiri::getWireFormat(void) const {
+    for (const auto &format : wireFormats) {
+        if (wireFormat == format.name) {
+            return format;
+        }
+    }
+
+    // AUTO: libmirisdr picks the densest packing the rate allows (always 16-bit samples)
+    for (const auto &format : wireFormats) {
+        if (sampleRate <= format.maxRate) {
+            return format;
+        }
+    }
+    return wireFormats[3];
 }
 
 std::vector<double> SoapyMiri::listSampleRates(const int direction, const size_t channel) const {
@@ -313,6 +534,19 @@ std::vector<double> SoapyMiri::listSampleRates(const int direction, const size_t
     results.push_back(10e6);
     results.push_back(12e6); // 12 Msps seems to be the limit for my MSI.SDR blue clone
 
+    // the top rate of every packing, only those the selected format can carry
+    double maxRate = wireFormats[3].maxRate;
+    for (const auto &format : wireFormats) {
+        if (wireFormat == format.name) {
+            maxRate = format.maxRate;
+        }
+        results.push_back(format.maxRate);
+    }
+    std::sort(results.begin(), results.end());
+    results.erase(std::unique(results.begin(), results.end()), results.end());
+    results.erase(std::remove_if(results.begin(), results.end(), [maxRate](double rate) { return rate > maxRate; }),
+                  results.end());
+
     return results;
 }
 
@@ -334,13 +568,11 @@ void SoapyMiri::setBandwidth(const int direction, const size_t channel, const do
     if (mirisdr_set_bandwidth(dev, (uint32_t) bw) != 0) {
         throw std::runtime_error("mirisdr_set_bandwidth failed");
     }
+    cacheState();
 }
 
 double SoapyMiri::getBandwidth(const int direction, const size_t channel) const {
-    if (!dev)
-        return 0;
-
-    return (double) mirisdr_get_bandwidth(dev);
+    return _state.load().bandwidth;
 }
 
 std::vector<double> SoapyMiri::listBandwidths(const int direction, const size_t channel) const {
@@ -409,12 +641,137 @@ SoapySDR::ArgInfoList SoapyMiri::getSettingInfo(void) const {
     }
     setArgs.push_back(flavourArg);
 
+    SoapySDR::ArgInfo sampleFormatArg;
+    sampleFormatArg.key = "sample_format";
+    sampleFormatArg.value = "AUTO";
+    sampleFormatArg.name = "USB sample format";
+    sampleFormatArg.description = "Sample packing on the USB: 14/12/10/8-bit in 16-bit words or 8-bit bytes. "
+                                  "Fewer bits allow higher rates, change while the stream is inactive";
+    sampleFormatArg.type = SoapySDR::ArgInfo::STRING;
+    sampleFormatArg.options.push_back("AUTO");
+    for (const auto &format : wireFormats) {
+        sampleFormatArg.options.push_back(format.name);
+    }
+    setArgs.push_back(sampleFormatArg);
+
+    SoapySDR::ArgInfo channelizerArg;
+    channelizerArg.key = "channelizer";
+    channelizerArg.value = "0";
+    channelizerArg.name = "Channelizer";
+    channelizerArg.description = "Split the band into this many channels (a power of two, 0 = off), takes effect on the next setupStream";
+    channelizerArg.type = SoapySDR::ArgInfo::INT;
+    setArgs.push_back(channelizerArg);
+
+    SoapySDR::ArgInfo channelOffsetsArg;
+    channelOffsetsArg.key = "channel_offsets";
+    channelOffsetsArg.value = "";
+    channelOffsetsArg.name = "Channel offsets";
+    channelOffsetsArg.description = "Expose only the channels at these offsets from the center frequency (Hz, separated by ';')";
+    channelOffsetsArg.units = "Hz";
+    channelOffsetsArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(channelOffsetsArg);
+
+    SoapySDR::ArgInfo triggerArg;
+    triggerArg.key = "trigger";
+    triggerArg.value = "";
+    triggerArg.name = "Trigger snapshot";
+    triggerArg.description = "Save a window of the lookback history around now, e.g. 'pre=2,post=0.5,path=/tmp/event.cs16' "
+                             "(seconds, needs the 'history' stream arg). Without a path the snapshot stays in memory; "
+                             "reading the setting returns its state and generation, the samples are read through "
+                             "the 'snapshot' register interface";
+    triggerArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(triggerArg);
+
+    SoapySDR::ArgInfo triggerReleaseArg;
+    triggerReleaseArg.key = "trigger_release";
+    triggerReleaseArg.value = "";
+    triggerReleaseArg.name = "Release snapshot";
+    triggerReleaseArg.description = "Free the in-memory snapshot of this generation (or 'all'), "
+                                    "at most " + std::to_string(MAX_SNAPSHOTS) + " are held at a time";
+    triggerReleaseArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(triggerReleaseArg);
+
+    SoapySDR::ArgInfo applyArg;
+    applyArg.key = "apply";
+    applyArg.value = "";
+    applyArg.name = "Apply settings";
+    applyArg.description = "Retune transaction, e.g. 'rf=100e6,bandwidth=8e6,LNA=1'. "
+                           "The first clean sample index is then available in 'clean_index'";
+    applyArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(applyArg);
+
+    SoapySDR::ArgInfo traceArg;
+    traceArg.key = "trace";
+    traceArg.value = "false";
+    traceArg.name = "Event tracing";
+    traceArg.description = "Record receive path events (needs a build with ENABLE_TRACE)";
+    traceArg.type = SoapySDR::ArgInfo::BOOL;
+    setArgs.push_back(traceArg);
+
+    SoapySDR::ArgInfo traceDumpArg;
+    traceDumpArg.key = "trace_dump";
+    traceDumpArg.value = "";
+    traceDumpArg.name = "Dump trace";
+    traceDumpArg.description = "Write the recorded events to this path as Chrome trace-event JSON (opens in Perfetto)";
+    traceDumpArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(traceDumpArg);
+
+    SoapySDR::ArgInfo stateArg;
+    stateArg.key = "state";
+    stateArg.value = "";
+    stateArg.name = "Settings state";
+    stateArg.description = "All cached device settings in one read, in the format of the 'apply' setting plus flavour, biastee and offset_tune";
+    stateArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(stateArg);
+
+    SoapySDR::ArgInfo statsArg;
+    statsArg.key = "stats";
+    statsArg.value = "";
+    statsArg.name = "Signal statistics";
+    statsArg.description = "RMS and peak (dBFS), clip count and DC level of the last statistics window (needs the 'stats' stream arg). "
+                           "The values are also available as 'rms_dbfs', 'peak_dbfs', 'clip_count', 'dc_i' and 'dc_q', "
+                           "'last_buffer_stats' has them for the last buffer handed out";
+    statsArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(statsArg);
+
+    SoapySDR::ArgInfo latencyArg;
+    latencyArg.key = "latency";
+    latencyArg.value = "";
+    latencyArg.name = "Delivery latency";
+    latencyArg.description = "Percentiles and jitter of the time from a USB transfer landing to readStream handing it out "
+                             "(needs the 'latency' stream arg), write 'reset' to start over";
+    latencyArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(latencyArg);
+
+    SoapySDR::ArgInfo recordArg;
+    recordArg.key = "record";
+    recordArg.value = "";
+    recordArg.name = "Record";
+    recordArg.description = "Record the stream losslessly, e.g. 'path=/data/capture.miq,codec=rice,threads=4'. "
+                            "codec=pack only bit-packs (minimum CPU), rice adds delta and entropy coding. Empty stops";
+    recordArg.type = SoapySDR::ArgInfo::STRING;
+    setArgs.push_back(recordArg);
+
+    SoapySDR::ArgInfo replaySeekArg;
+    replaySeekArg.key = "replay_seek";
+    replaySeekArg.value = "0";
+    replaySeekArg.name = "Replay position";
+    replaySeekArg.description = "Continue the replay from this time in the recording";
+    replaySeekArg.units = "s";
+    replaySeekArg.type = SoapySDR::ArgInfo::FLOAT;
+    setArgs.push_back(replaySeekArg);
+
     return setArgs;
 }
 
 void SoapyMiri::writeSetting(const std::string &key, const std::string &value) {
-    if (!dev)
+    if (!dev && !_replay && !_simulated)
+        return;
+
+    if (!dev && (key == "offset_tune" || key == "biastee" || key == "flavour" || key == "sample_format")) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "MiriSDR setting '%s' needs the hardware, ignored", key.c_str());
         return;
+    }
 
     if (key == "offset_tune") {
         bool offsetMode = (value == "true");
@@ -423,41 +780,350 @@ void SoapyMiri::writeSetting(const std::string &key, const std::string &value) {
         if (mirisdr_set_offset_tuning(dev, offsetMode ? 1 : 0) != 0) {
             throw std::runtime_error("mirisdr_set_offset_tuning failed");
         }
+        cacheState();
     } else if (key == "biastee") {
         bool enableBiasTee = (value == "true");
         SoapySDR_logf(SOAPY_SDR_DEBUG, "MiriSDR bias tee mode: %s", enableBiasTee ? "true" : "false");
         mirisdr_set_bias(dev, enableBiasTee ? 1 : 0);
+        cacheState();
     } else if (key == "flavour") {
         if (flavourMap.count(value)) {
             mirisdr_set_hw_flavour(dev, flavourMap[value]);
             hwFlavour = flavourMap[value];
+            cacheState();
         } else {
             SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR invalid HW flavour: %s", value.c_str());
         }
+    } else if (key == "sample_format") {
+        if (!_paused) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR sample format can't be changed while streaming");
+            return;
+        }
+        // the USB transfers are set up for the old format, restart them on the next activateStream,
+        // which also redoes the stream's wire parameters for the new format
+        stopRxThread();
+        bool known = (value == "AUTO");
+        for (const auto &format : wireFormats) {
+            known |= (value == format.name);
+        }
+        if (!known) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR invalid sample format: %s", value.c_str());
+            return;
+        }
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "MiriSDR sample format: %s", value.c_str());
+        if (mirisdr_set_sample_format(dev, (char *) value.c_str()) != 0) {
+            throw std::runtime_error("mirisdr_set_sample_format failed");
+        }
+        wireFormat = value;
+    } else if (key == "channelizer") {
+        if (!_paused) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR channelizer can't be changed while streaming");
+            return;
+        }
+        const int bins = std::stoi(value);
+        if (bins != 0 && (bins < 2 || (bins & (bins - 1)) != 0)) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR channelizer needs a power of two channels: %s", value.c_str());
+            return;
+        }
+        channelizerBins = (size_t) bins;
+    } else if (key == "channel_offsets") {
+        channelOffsets.clear();
+        size_t start = 0;
+        while (start < value.size()) {
+            size_t end = value.find(';', start);
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+            if (end > start) {
+                channelOffsets.push_back(std::stod(value.substr(start, end - start)));
+            }
+            start = end + 1;
+        }
+        if (_channelizer && channelOffsets.size() == _streamChannels.size()) {
+            updateChannelBins();
+        }
+    } else if (key == "trigger") {
+        triggerSnapshot(SoapySDR::KwargsFromString(value));
+    } else if (key == "simulate_drop") {
+        // the simulated device loses this many transfers, like a USB hiccup
+        if (!_simulated) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR simulate_drop needs a device opened with 'simulate'");
+            return;
+        }
+        _simulateDrop += (unsigned) std::stoul(value);
+    } else if (key == "trigger_release") {
+        releaseSnapshot(value);
+    } else if (key == "apply") {
+        applySettings(SoapySDR::KwargsFromString(value));
+    } else if (key == "trace") {
+#ifndef SOAPY_MIRI_TRACE
+        SoapySDR_logf(SOAPY_SDR_WARNING, "MiriSDR was built without ENABLE_TRACE, no events will be recorded");
+#endif
+        if (value == "true") {
+            MiriTrace::clear();
+        }
+        MiriTrace::enabled = (value == "true");
+    } else if (key == "trace_dump") {
+        MiriTrace::dumpChromeJson(value);
+    } else if (key == "latency") {
+        if (value == "reset") {
+            std::lock_guard<std::mutex> lock(_latencyMutex);
+            _latencyUs.clear();
+            _latencyNext = 0;
+        }
+    } else if (key == "record") {
+        std::unique_ptr<MiriRecorder> recorder;
+        if (!value.empty()) {
+            // a bare path records with the defaults
+            SoapySDR::Kwargs args;
+            if (value.find('=') == std::string::npos) {
+                args["path"] = value;
+            } else {
+                args = SoapySDR::KwargsFromString(value);
+            }
+            if (args.count("path") == 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR record: missing path");
+                return;
+            }
+            const std::string codec = args.count("codec") != 0 ? args.at("codec") : "pack";
+            if (codec != "pack" && codec != "rice") {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR record: invalid codec '%s'", codec.c_str());
+                return;
+            }
+            int threads = 2;
+            if (args.count("threads") != 0) {
+                try {
+                    threads = std::stoi(args.at("threads"));
+                }
+                catch (const std::logic_error &) {
+                    threads = 0;
+                }
+                if (threads <= 0) {
+                    SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR record: invalid threads '%s'", args.at("threads").c_str());
+                    return;
+                }
+            }
+            recorder.reset(new MiriRecorder(args.at("path"), codec == "rice" ? MIRI_CODEC_RICE : MIRI_CODEC_PACK,
+                                            sampleRate, _state.load().frequency, (size_t) threads));
+        }
+        {
+            std::lock_guard<std::mutex> rxLock(_rx_mutex);
+            std::swap(recorder, _recorder);
+        }
+        // the previous recorder finishes its queue and writes the index outside the lock
+    } else if (key == "replay_seek") {
+        if (!_replay) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR replay_seek needs a device opened with 'replay'");
+            return;
+        }
+        // takes effect with the next block, a forward seek moves the timestamps along
+        _replayBlock = _replay->findBlock(this->timeNsToTicks((long long) (std::stod(value) * 1e9)));
     }
 
 }
 
 std::string SoapyMiri::readSetting(const std::string &key) const {
-    if (!dev)
-        return "";
-
     if (key == "offset_tune") {
         // TODO: create `mirisdr_get_offset_tuning`
-        return isOffsetTuning ? "true" : "false";
+        return _state.load().offsetTuning ? "true" : "false";
     } else if (key == "biastee") {
-        return mirisdr_get_bias(dev) ? "true" : "false";
+        return _state.load().biasTee ? "true" : "false";
     } else if (key == "flavour") {
+        const int flavour = _state.load().flavour;
         for (const auto &entry : flavourMap) {
-            if (entry.second == hwFlavour) {
+            if (entry.second == flavour) {
                 return entry.first;
             }
         }
         // assert: flavour set to something impossible
-        SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR HW flavour set to unknown value: %d", hwFlavour);
+        SoapySDR_logf(SOAPY_SDR_ERROR, "MiriSDR HW flavour set to unknown value: %d", (int) flavour);
         return "";
+    } else if (key == "trace") {
+        return MiriTrace::enabled ? "true" : "false";
+    } else if (key == "sample_format") {
+        return wireFormat;
+    } else if (key == "channelizer") {
+        return std::to_string(channelizerBins);
+    } else if (key == "trigger") {
+        return snapshotStatus();
+    } else if (key == "state") {
+        // one consistent snapshot of all the cached settings
+        const MiriSettingsState state = _state.load();
+        SoapySDR::Kwargs result;
+        result["rf"] = std::to_string(state.frequency);
+        result["rate"] = std::to_string(state.sampleRate);
+        result["bandwidth"] = std::to_string(state.bandwidth);
+        result["gain_mode"] = state.gainMode ? "true" : "false";
+        result["Automatic"] = std::to_string(state.tunerGain);
+        result["LNA"] = std::to_string(state.lnaGain);
+        result["Baseband"] = std::to_string(state.basebandGain);
+        result["Mixer"] = std::to_string(state.mixerGain);
+        result["Mixbuffer"] = std::to_string(state.mixbufferGain);
+        result["biastee"] = state.biasTee ? "true" : "false";
+        result["offset_tune"] = state.offsetTuning ? "true" : "false";
+        for (const auto &entry : flavourMap) {
+            if (entry.second == state.flavour) {
+                result["flavour"] = entry.first;
+            }
+        }
+        return SoapySDR::KwargsToString(result);
+    } else if (key == "latency") {
+        return latencyStatus();
+    } else if (key == "stats") {
+        // last complete window, see the 'stats' and 'statsWindow' stream args
+        return statsToString(_statsWindow.load());
+    } else if (key == "last_buffer_stats") {
+        return statsToString(_lastBufferStats.load());
+    } else if (key == "rms_dbfs" || key == "peak_dbfs" || key == "clip_count" || key == "dc_i" || key == "dc_q") {
+        return statsValue(_statsWindow.load(), key);
+    } else if (key == "record") {
+        std::lock_guard<std::mutex> rxLock(_rx_mutex);
+        return _recorder ? _recorder->status() : "";
+    } else if (key == "activate_latency_us") {
+        // time from the last activateStream to its first sample handed out, -1 until then
+        return std::to_string(_activateLatencyUs.load());
+    } else if (key == "clean_index") {
+        return std::to_string(_cleanIndex.load());
+    } else if (key == "dropped_samples") {
+        return std::to_string(_droppedSamples.load());
+    } else if (key == "last_overflow") {
+        // the loss behind the last SOAPY_SDR_OVERFLOW readStream/acquireReadBuffer returned
+        std::lock_guard<std::mutex> lock(_buf_mutex);
+        if (_lastLossElems == 0) {
+            return "";
+        }
+        return std::to_string(_lastLossIndex) + ":" + std::to_string(_lastLossElems);
+    } else if (key == "overflow_events") {
+        // most recent losses as "first_sample_index:sample_count", in sample order
+        std::lock_guard<std::mutex> lock(_buf_mutex);
+        std::string events;
+        for (const auto &loss : _lossLog) {
+            if (!events.empty()) {
+                events += " ";
+            }
+            events += std::to_string(loss.first) + ":" + std::to_string(loss.second);
+        }
+        return events;
+    } else if (key == "power_dbfs") {
+        // average power since the previous read, accumulated by the conversion kernel
+        std::lock_guard<std::mutex> lock(_powerMutex);
+        if (_powerCount == 0) {
+            return "";
+        }
+        double meanPower = _powerSum / _powerCount / (32768.0 * 32768.0);
+        _powerSum = 0;
+        _powerCount = 0;
+        return std::to_string(10.0 * std::log10(meanPower + 1e-20));
     }
 
     SoapySDR_logf(SOAPY_SDR_WARNING, "Unknown setting '%s'", key.c_str());
     return "";
 }
+
+void SoapyMiri::applySettings(const SoapySDR::Kwargs &args) {
+    std::lock_guard<std::mutex> lock(_tuneMutex);
+
+    auto number = [&args](const std::string &key) {
+        try {
+            return std::stod(args.at(key));
+        }
+        catch (const std::logic_error &) {
+            throw std::runtime_error("applySettings: invalid value for '" + key + "'");
+        }
+    };
+
+    const std::vector<std::string> gains = listGains(SOAPY_SDR_RX, 0);
+    for (const auto &entry : args) {
+        if (entry.first != "rf" && entry.first != "rate" && entry.first != "bandwidth" && entry.first != "gain_mode" &&
+            std::find(gains.begin(), gains.end(), entry.first) == gains.end()) {
+            SoapySDR_logf(SOAPY_SDR_WARNING, "applySettings: unknown key '%s'", entry.first.c_str());
+        }
+    }
+
+    // writes run back to back in the order the tuner needs them; values that are already set are skipped.
+    // Without a dongle (simulated, replay) only the rate of a simulated device applies, the ring
+    // bookkeeping below runs either way
+    if (args.count("rate") != 0 && _simulated && number("rate") != sampleRate) {
+        this->sampleRate = number("rate");
+        updateChannelBins();
+    }
+
+    if (dev && args.count("rate") != 0 && (uint32_t) number("rate") != mirisdr_get_sample_rate(dev)) {
+        if (mirisdr_set_sample_rate(dev, (uint32_t) number("rate")) != 0) {
+            throw std::runtime_error("mirisdr_set_sample_rate failed");
+        }
+        this->sampleRate = (double) mirisdr_get_sample_rate(dev);
+        updateChannelBins();
+        if (wireFormat == "AUTO") {
+            std::lock_guard<std::mutex> rxLock(_rx_mutex);
+            _clipLevel = wireClipLevel();
+        }
+    }
+
+    if (dev && args.count("bandwidth") != 0 && (uint32_t) number("bandwidth") != mirisdr_get_bandwidth(dev)) {
+        if (mirisdr_set_bandwidth(dev, (uint32_t) number("bandwidth")) != 0) {
+            throw std::runtime_error("mirisdr_set_bandwidth failed");
+        }
+    }
+
+    if (dev && args.count("rf") != 0 && (uint32_t) number("rf") != mirisdr_get_center_freq(dev)) {
+        MIRI_TRACE(EVENT_RETUNE, number("rf"));
+        if (mirisdr_set_center_freq(dev, (uint32_t) number("rf")) != 0) {
+            throw std::runtime_error("mirisdr_set_center_freq failed");
+        }
+    }
+
+    if (dev && args.count("gain_mode") != 0) {
+        const bool automatic = (args.at("gain_mode") == "true");
+        if (automatic != getGainMode(SOAPY_SDR_RX, 0)) {
+            setGainMode(SOAPY_SDR_RX, 0, automatic);
+        }
+    }
+
+    for (const auto &gain : gains) {
+        if (dev && args.count(gain) != 0 && number(gain) != getGain(SOAPY_SDR_RX, 0, gain)) {
+            setGain(SOAPY_SDR_RX, 0, gain, number(gain));
+        }
+    }
+
+    // flush the ring once for the whole transaction, the clean stream starts past the transfers in flight
+    const unsigned long long cleanIndex = this->cleanTick();
+    _discardBefore = cleanIndex;
+    _cleanIndex = cleanIndex;
+    resetBuffer = true;
+    cacheState();
+
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "MiriSDR settings applied, clean from sample %llu", cleanIndex);
+}
+
+/*******************************************************************
+ * Register API
+ ******************************************************************/
+
+std::vector<std::string> SoapyMiri::listRegisterInterfaces(void) const {
+    return {"snapshot"};
+}
+
+std::vector<unsigned> SoapyMiri::readRegisters(const std::string &name, const unsigned addr, const size_t length) const {
+    // in-memory snapshots, one CS16 sample per register (I in the low, Q in the high 16 bits) and addr
+    // the first sample; 'snapshot' reads the last trigger's, 'snapshot:<generation>' any held one
+    unsigned generation = _snapshotGeneration;
+    if (name.compare(0, 9, "snapshot:") == 0) {
+        try {
+            generation = (unsigned) std::stoul(name.substr(9));
+        }
+        catch (const std::logic_error &) {
+            throw std::runtime_error("readRegisters: invalid snapshot generation in '" + name + "'");
+        }
+    } else if (name != "snapshot") {
+        throw std::runtime_error("readRegisters: unknown interface '" + name + "'");
+    }
+
+    std::vector<int16_t> samples(length * 2);
+    const size_t numElems = readSnapshot(generation, addr, samples.data(), length);
+    std::vector<unsigned> registers(numElems);
+    for (size_t i = 0; i < numElems; i++) {
+        registers[i] = (unsigned) (uint16_t) samples[i * 2] | ((unsigned) (uint16_t) samples[i * 2 + 1] << 16);
+    }
+    return registers;
+}
@@ -4,19 +4,85 @@
 #include <SoapySDR/Logger.h>
 #include <SoapySDR/Types.h>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <deque>
 #include "mirisdr.h"
+#include "Conversion.hpp"
+#include "Trace.hpp"
+#include "Channelizer.hpp"
+#include "Recording.hpp"
+#include "Seqlock.hpp"
+#include <memory>
 
 #define DEFAULT_BUFFER_LENGTH (2304 * 8 * 2)
 #define DEFAULT_NUM_BUFFERS 15
 #define BYTES_PER_SAMPLE 2
-
-typedef enum miriSampleFormat {
-    MIRI_FORMAT_CS16,
-    MIRI_FORMAT_CF32,
-} miriSampleFormat;
+#define MAX_OVERFLOW_LOG 64
+#define LATENCY_WINDOW 65536
+#define MAX_SNAPSHOTS 4
+#define DEFAULT_SIMULATED_RATE 2048000
+
+// sample packing on the USB side, see `mirisdr_set_sample_format`
+struct MiriWireFormat {
+    const char *name;
+    size_t bytesPerSample; // per I or Q component, as handed to the async callback
+    int bits; // ADC bits carried
+    double maxRate;
+};
+
+/*!
+ * Device settings as last set, so the getters don't call into libmirisdr.
+ * Refreshed from libmirisdr after every setter (the tuner gain moves the stage gains).
+ */
+struct MiriSettingsState {
+    double frequency;
+    double sampleRate;
+    double bandwidth;
+    double tunerGain;
+    double lnaGain;
+    double basebandGain;
+    double mixerGain;
+    double mixbufferGain;
+    int tunerGainMax;
+    int flavour;
+    bool gainMode;
+    bool biasTee;
+    bool offsetTuning;
+};
+
+/*!
+ * Buffer statistics summed over a span of samples: one buffer or a stats window.
+ */
+struct MiriStatsWindow {
+    unsigned long long startTick;
+    unsigned long long numElems;
+    double powerSum; // per-buffer means weighted by the buffer's samples
+    double dcISum;
+    double dcQSum;
+    float peak;
+    unsigned long long clipped;
+};
+
+typedef enum miriTriggerState {
+    MIRI_TRIGGER_IDLE,
+    MIRI_TRIGGER_PENDING, // waiting for the post-trigger part to be received
+    MIRI_TRIGGER_READY,
+    MIRI_TRIGGER_FAILED,
+} miriTriggerState;
+
+typedef enum miriGate {
+    MIRI_GATE_PENDING, // idle so far, may still be handed out as squelch pre-padding
+    MIRI_GATE_PASS,
+} miriGate;
+
+typedef enum miriOverflowPolicy {
+    MIRI_OVERFLOW_DRAIN, // drop new transfers, flush the whole ring once the reader notices
+    MIRI_OVERFLOW_DROP_NEWEST, // drop new transfers, keep the queued ones
+    MIRI_OVERFLOW_DROP_OLDEST, // overwrite the oldest queued transfer
+} miriOverflowPolicy;
 
 class SoapyMiri : public SoapySDR::Device {
 public:
@@ -75,6 +141,14 @@ public:
             long long &timeNs,
             const long timeoutUs = 100000);
 
+    /*******************************************************************
+     * Time API
+     ******************************************************************/
+
+    bool hasHardwareTime(const std::string &what = "") const;
+
+    long long getHardwareTime(const std::string &what = "") const;
+
     /*******************************************************************
      * Direct buffer access API
      ******************************************************************/
@@ -186,6 +260,19 @@ public:
 
     std::string readSetting(const std::string &key) const;
 
+    void applySettings(const SoapySDR::Kwargs &args);
+
+    /*******************************************************************
+     * Register API
+     ******************************************************************/
+
+    std::vector<std::string> listRegisterInterfaces(void) const;
+
+    std::vector<unsigned> readRegisters(const std::string &name, const unsigned addr, const size_t length) const;
+
+    // copies samples of an in-memory snapshot (CS16) out, returns how many
+    size_t readSnapshot(const unsigned generation, const size_t offset, int16_t *out, const size_t numElems) const;
+
     /*******************************************************************
      * Utility
      ******************************************************************/
@@ -206,34 +293,234 @@ private:
         { "SDRplay", MIRISDR_HW_SDRPLAY },
     };
     mirisdr_hw_flavour_t hwFlavour = MIRISDR_HW_DEFAULT;
+    std::string wireFormat = "AUTO";
+    size_t channelizerBins; // 0 = channelizer off
+    std::vector<double> channelOffsets; // user-listed channels, empty = all bins
+    std::mutex _tuneMutex;
+    std::atomic<unsigned long long> _discardBefore;
+    std::atomic<unsigned long long> _cleanIndex;
+    MiriSeqlock<MiriSettingsState> _state; // read lock-free by the getters
+
+    void cacheState(void);
 
 public:
     struct Buffer {
         unsigned long long tick;
+        MiriBufferStats stats; // only measured with the squelch or the stats on
+        miriGate gate; // squelch decision, made once by the rx thread when the buffer is published
+        std::chrono::steady_clock::time_point arrival; // USB transfer landed, only with the 'latency' stream arg
         std::vector<signed char> data;
+        std::vector<char> converted; // data in the stream format, one segment per channel with the channelizer
+        bool convertedValid; // converted holds this buffer's data (_rxConvert was on when it was published)
     };
 
     //async api usage
     std::thread _rx_async_thread;
+    mutable std::mutex _rx_mutex; // held by every callback, so state changes never race one
+    std::atomic<bool> _rxRunning;
+    std::atomic<bool> _paused;
+    std::chrono::steady_clock::time_point _activateTime;
+    std::atomic<bool> _firstSamplePending;
+    std::atomic<long long> _activateLatencyUs;
 
     void rx_async_operation(void);
 
+    void replay_operation(void);
+
+    void simulate_operation(void);
+
+    void stopRxThread(void);
+
+    void markFirstSample(void);
+
+    void recordLatency(const std::chrono::steady_clock::time_point &arrival);
+
+    static void addStats(MiriStatsWindow &window, unsigned long long tick, size_t numElems, const MiriBufferStats &stats);
+
+    void accumulateStats(unsigned long long tick, size_t numElems, const MiriBufferStats &stats);
+
+    std::string statsValue(const MiriStatsWindow &window, const std::string &key) const;
+
+    std::string statsToString(const MiriStatsWindow &window) const;
+
+    std::string latencyStatus(void) const;
+
     void rx_callback(unsigned char *buf, uint32_t len);
 
+    void recordLoss(const unsigned long long tick, const size_t numElems);
+
+    void gateBuffers(void);
+
+    void convertBuffer(Buffer &buff);
+
+    void startRxConvert(void);
+
+    int acquireBuffer(size_t &handle, int &flags, long long &timeNs, const long timeoutUs);
+
+    void triggerSnapshot(const SoapySDR::Kwargs &args);
+
+    void snapshotOperation(unsigned long long startTick, size_t numElems, std::string path, unsigned generation);
+
+    void releaseSnapshot(const std::string &which);
+
+    std::string snapshotStatus(void) const;
+
+    int readFragment(
+            SoapySDR::Stream *stream,
+            void *const *outs,
+            const size_t outOffset,
+            const size_t numElems,
+            int &flags,
+            long long &timeNs,
+            const long timeoutUs,
+            const bool stopAtGap);
+
+    int readBurst(
+            void *const *buffs,
+            const size_t numElems,
+            int &flags,
+            long long &timeNs,
+            const long timeoutUs);
+
+    long long ticksToTimeNs(const unsigned long long ticks) const;
+
+    unsigned long long timeNsToTicks(const long long timeNs) const;
+
+    unsigned long long cleanTick(void) const;
+
+    size_t channelBin(const size_t channel) const;
+
+    void updateChannelBins(void);
+
+    const MiriWireFormat &getWireFormat(void) const;
+
+    int32_t wireClipLevel(void) const;
+
+    void updateWireFormat(void);
+
     // driver options
     size_t optNumBuffers;
     size_t optBufferLength;
-
-    std::vector<Buffer> buffs;
+    bool optFillRead;
+    bool optDCRemoval;
+    bool optPower;
+    float optScale;
+    miriOverflowPolicy optOverflowPolicy;
+    bool optSquelch;
+    float optSquelchLevel; // linear power
+    unsigned long long optHangSamples;
+    size_t optSquelchPre;
+    size_t optSquelchPost;
+    bool optLatency;
+    bool optStats;
+    unsigned long long optStatsWindowElems;
+
+    std::vector<Buffer> buffs; // indexed by handle
+    std::vector<size_t> _bufOrder; // ring position -> handle, drop_oldest reorders these instead of moving buffers
     size_t _buf_head;
     size_t _buf_tail;
     std::atomic<size_t> _buf_count;
-    int16_t *_currentBuff;
+    size_t _buf_held;
+    unsigned long long _gateHangUntil;
+    size_t _gatePostLeft;
+    unsigned long long _acquireNextTick;
+    bool _acquireNextTickValid;
+    size_t _currentOffset; // input elements of the current buffer already handed out
     std::atomic<bool> _overflowEvent;
     size_t _currentHandle;
     size_t remainingElems;
+    size_t _elemSize;
+    MiriConvertFn _convert;
+    bool _rxConvertFormat; // the stream format isn't the raw CS16, direct access needs converted buffers
+    std::atomic<bool> _rxConvert; // the rx thread converts, switched on by the first direct access
+    std::vector<float *> _rxChannelTargets; // the rx thread's channelizer outputs
+    size_t _segmentElems; // per-channel stride of the converted buffers, in output elements
+    MiriIngestFn _ingest; // into the ring, measures the buffers for the squelch and the stats
+    MiriIngestFn _unpack; // history and burst, no measurements
+    int32_t _clipLevel; // int16 magnitude of the wire format's largest code
+    size_t _wireBytesPerSample;
+    std::unique_ptr<MiriChannelizer> _channelizer;
+    std::vector<size_t> _streamChannels;
+    std::vector<float *> _channelTargets; // per-call output pointers, sized by setupStream
+    std::mutex _binsMutex;
+    std::vector<size_t> _pendingBins; // new bin selection after a rate change, guarded by _binsMutex
+    std::atomic<bool> _binsChanged;
+    MiriConvertState _convertState;
+    mutable std::mutex _powerMutex;
+    mutable double _powerSum;
+    mutable unsigned long long _powerCount;
+    std::atomic<unsigned long long> _sampleTick;
+    unsigned long long _acquiredTick;
+    std::chrono::steady_clock::time_point _acquiredArrival;
+    std::chrono::steady_clock::time_point _currentArrival;
+    unsigned long long _currentTick;
+    unsigned long long _nextTick;
+    bool _nextTickValid;
     std::atomic<bool> resetBuffer;
-    std::mutex _buf_mutex;
+    // finite capture (activateStream with SOAPY_SDR_END_BURST)
+    std::atomic<bool> _burstActive;
+    std::vector<int16_t> _burst;
+    size_t _burstElems;
+    std::atomic<size_t> _burstFill;
+    size_t _burstRead;
+    unsigned long long _burstTick;
+    std::atomic<bool> _burstStopped; // a completed burst ended the rx thread, the next start keeps the counter
+
+    // stats of the transfers in the burst buffer, so readBurst can publish them like acquireReadBuffer
+    struct BurstStats {
+        unsigned long long tick;
+        size_t numElems;
+        MiriBufferStats stats;
+    };
+    std::vector<BurstStats> _burstStats; // appended under _buf_mutex
+    size_t _burstStatsNext; // first entry readBurst hasn't passed yet
+    std::atomic<unsigned long long> _activateTick;
+
+    // lookback history, written continuously by the rx thread
+    std::vector<int16_t> _history;
+    size_t _historyElems;
+    std::atomic<unsigned long long> _historyWrite; // tick after the newest sample in the history
+    std::atomic<size_t> _historyMaxWrite; // most samples one callback wrote into the history
+    std::thread _snapshotThread;
+    std::atomic<int> _snapshotState;
+    std::atomic<bool> _snapshotAbort;
+    mutable std::mutex _snapshotMutex;
+    std::map<unsigned, std::vector<int16_t>> _snapshots; // in-memory snapshots by generation, until released
+    std::atomic<unsigned> _snapshotGeneration; // of the last trigger
+    unsigned long long _snapshotTick; // last completed snapshot, guarded by _snapshotMutex
+    size_t _snapshotElems;
+    std::string _snapshotPath;
+
+    // compressed recording of the stream and replay of one in place of the dongle
+    std::unique_ptr<MiriRecorder> _recorder; // swapped under _rx_mutex
+    std::unique_ptr<MiriReplay> _replay;
+    std::atomic<bool> _replayStop; // also ends the simulation
+    bool _simulated; // `simulate=true|counter|marker`: synthetic transfers instead of a dongle
+    bool _simulateCounter; // samples carry the sample counter instead of the tone
+    bool _simulateMarker; // the first sample of every transfer carries its handover time
+    std::atomic<unsigned> _simulateDrop; // transfers to lose
+    std::atomic<size_t> _replayBlock;
+
+    mutable std::mutex _buf_mutex;
     std::condition_variable _buf_cond;
 
+    // sample loss accounting, guarded by _buf_mutex
+    std::atomic<unsigned long long> _droppedSamples;
+    unsigned long long _lossIndex;
+    unsigned long long _lossElems;
+    unsigned long long _lastLossIndex; // the event last reported by an SOAPY_SDR_OVERFLOW return
+    unsigned long long _lastLossElems;
+    std::deque<std::pair<unsigned long long, unsigned long long>> _lossLog;
+
+    // signal statistics: the window being summed by the rx thread, the last complete window and
+    // the last buffer handed out by acquireReadBuffer
+    MiriStatsWindow _statsAccum;
+    MiriSeqlock<MiriStatsWindow> _statsWindow;
+    MiriSeqlock<MiriStatsWindow> _lastBufferStats;
+
+    // delivery latency of the last LATENCY_WINDOW buffers, transfer landing to readStream returning it
+    mutable std::mutex _latencyMutex;
+    std::vector<float> _latencyUs;
+    size_t _latencyNext;
+
 };
\ No newline at end of file
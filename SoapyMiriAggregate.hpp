@@ -0,0 +1,186 @@
+#pragma once
+
+#include "SoapyMiri.hpp"
+#include <memory>
+
+/*!
+ * Several MiriSDR dongles opened side by side (`serials=A;B;C`), each one exposed as an RX channel.
+ * Every dongle keeps its own rx thread and ring; readStream reads all of them in fill mode into a
+ * staging buffer per channel and hands out the span all channels have, lined up on the sample
+ * counters. What one channel has beyond that span stays staged for the next call. Each counter
+ * starts at its own dongle's activation, so equal counters aren't equal times: the activation delay
+ * between the dongles stays in the data unless 'counter_offset' takes it out. The dongles also run
+ * on independent clocks, so the alignment holds the counter offsets fixed but doesn't correct drift.
+ */
+class SoapyMiriAggregate : public SoapySDR::Device {
+public:
+    SoapyMiriAggregate(const SoapySDR::Kwargs &args);
+
+    /*******************************************************************
+     * Identification API
+     ******************************************************************/
+
+    std::string getDriverKey(void) const;
+
+    std::string getHardwareKey(void) const;
+
+    SoapySDR::Kwargs getHardwareInfo(void) const;
+
+    /*******************************************************************
+     * Channels API
+     ******************************************************************/
+
+    size_t getNumChannels(const int) const;
+
+    bool getFullDuplex(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Stream API
+     ******************************************************************/
+
+    std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const;
+
+    std::string getNativeStreamFormat(const int direction, const size_t channel, double &fullScale) const;
+
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const;
+
+    SoapySDR::Stream *setupStream(const int direction, const std::string &format, const std::vector<size_t> &channels =
+    std::vector<size_t>(), const SoapySDR::Kwargs &args = SoapySDR::Kwargs());
+
+    void closeStream(SoapySDR::Stream *stream);
+
+    size_t getStreamMTU(SoapySDR::Stream *stream) const;
+
+    int activateStream(
+            SoapySDR::Stream *stream,
+            const int flags = 0,
+            const long long timeNs = 0,
+            const size_t numElems = 0);
+
+    int deactivateStream(SoapySDR::Stream *stream, const int flags = 0, const long long timeNs = 0);
+
+    int readStream(
+            SoapySDR::Stream *stream,
+            void *const *buffs,
+            const size_t numElems,
+            int &flags,
+            long long &timeNs,
+            const long timeoutUs = 100000);
+
+    /*******************************************************************
+     * Antenna API
+     ******************************************************************/
+
+    std::vector<std::string> listAntennas(const int direction, const size_t channel) const;
+
+    void setAntenna(const int direction, const size_t channel, const std::string &name);
+
+    std::string getAntenna(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Gain API
+     ******************************************************************/
+
+    std::vector<std::string> listGains(const int direction, const size_t channel) const;
+
+    bool hasGainMode(const int direction, const size_t channel) const;
+
+    void setGainMode(const int direction, const size_t channel, const bool automatic);
+
+    bool getGainMode(const int direction, const size_t channel) const;
+
+    void setGain(const int direction, const size_t channel, const double value);
+
+    void setGain(const int direction, const size_t channel, const std::string &name, const double value);
+
+    double getGain(const int direction, const size_t channel, const std::string &name) const;
+
+    SoapySDR::Range getGainRange(const int direction, const size_t channel, const std::string &name) const;
+
+    /*******************************************************************
+     * Frequency API
+     ******************************************************************/
+
+    void setFrequency(
+            const int direction,
+            const size_t channel,
+            const std::string &name,
+            const double frequency,
+            const SoapySDR::Kwargs &args = SoapySDR::Kwargs());
+
+    double getFrequency(const int direction, const size_t channel, const std::string &name) const;
+
+    std::vector<std::string> listFrequencies(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getFrequencyRange(const int direction, const size_t channel, const std::string &name) const;
+
+    SoapySDR::ArgInfoList getFrequencyArgsInfo(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Sample Rate API
+     ******************************************************************/
+
+    void setSampleRate(const int direction, const size_t channel, const double rate);
+
+    double getSampleRate(const int direction, const size_t channel) const;
+
+    std::vector<double> listSampleRates(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getSampleRateRange(const int direction, const size_t channel) const;
+
+    void setBandwidth(const int direction, const size_t channel, const double bw);
+
+    double getBandwidth(const int direction, const size_t channel) const;
+
+    std::vector<double> listBandwidths(const int direction, const size_t channel) const;
+
+    SoapySDR::RangeList getBandwidthRange(const int direction, const size_t channel) const;
+
+    /*******************************************************************
+     * Settings API
+     ******************************************************************/
+
+    SoapySDR::ArgInfoList getSettingInfo(void) const;
+
+    void writeSetting(const std::string &key, const std::string &value);
+
+    std::string readSetting(const std::string &key) const;
+
+    void writeSetting(const int direction, const size_t channel, const std::string &key, const std::string &value);
+
+    std::string readSetting(const int direction, const size_t channel, const std::string &key) const;
+
+    /*******************************************************************
+     * Utility
+     ******************************************************************/
+
+    static std::vector<std::string> parseSerials(const std::string &serials);
+
+private:
+    SoapyMiri &member(const size_t channel) const;
+
+    std::vector<std::string> serials;
+    std::vector<std::unique_ptr<SoapyMiri>> members;
+
+    // samples read from one channel but not handed out yet
+    struct Staged {
+        std::vector<char> data;
+        size_t offset; // first element not handed out
+        size_t count; // elements left
+        long long tick; // aligned sample counter of data[offset]
+    };
+
+    int fillStaged(const size_t index, const size_t numElems, const long timeoutUs);
+
+    std::vector<long long> counterOffsets; // per channel, added to the dongle's sample counter ('counter_offset')
+
+    // stream state
+    std::vector<size_t> streamChannels;
+    std::vector<SoapySDR::Stream *> memberStreams;
+    std::vector<Staged> staged; // per stream channel
+    size_t elemSize;
+    long long nextTick; // aligned counter after the last sample handed out
+    bool nextTickValid;
+    long long lastAlignDrop; // 'align_drop'
+    unsigned long long alignDropEvents; // 'align_drop_events'
+};
@@ -1,12 +1,18 @@
 #include "SoapyMiri.hpp"
 #include <SoapySDR/Logger.hpp>
 #include <SoapySDR/Formats.hpp>
+#include <algorithm>
 #include <cstring>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iterator>
 
 std::vector<std::string> SoapyMiri::getStreamFormats(const int direction, const size_t channel) const {
     return {
         SOAPY_SDR_CS16,
         SOAPY_SDR_CF32,
+        SOAPY_SDR_CS8,
     };
 }
 
@@ -48,6 +54,133 @@ SoapySDR::ArgInfoList SoapyMiri::getStreamArgsInfo(const int direction, const si
 
     streamArgs.push_back(asyncbuffsArg);
 
+    SoapySDR::ArgInfo fillReadArg;
+    fillReadArg.key = "fillRead";
+    fillReadArg.value = "false";
+    fillReadArg.name = "Fill reads";
+    fillReadArg.description = "Fill the whole readStream request across ring buffers (until timeout) instead of returning one buffer per call.";
+    fillReadArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(fillReadArg);
+
+    SoapySDR::ArgInfo scaleArg;
+    scaleArg.key = "scale";
+    scaleArg.value = "1.0";
+    scaleArg.name = "Scale";
+    scaleArg.description = "Gain applied to the samples on top of the format's full scale.";
+    scaleArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(scaleArg);
+
+    SoapySDR::ArgInfo dcRemovalArg;
+    dcRemovalArg.key = "dcRemoval";
+    dcRemovalArg.value = "false";
+    dcRemovalArg.name = "DC removal";
+    dcRemovalArg.description = "Subtract a running DC estimate during conversion.";
+    dcRemovalArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(dcRemovalArg);
+
+    SoapySDR::ArgInfo powerArg;
+    powerArg.key = "power";
+    powerArg.value = "false";
+    powerArg.name = "Power measurement";
+    powerArg.description = "Accumulate signal power during conversion, read with the 'power_dbfs' setting.";
+    powerArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(powerArg);
+
+    SoapySDR::ArgInfo overflowArg;
+    overflowArg.key = "overflow";
+    overflowArg.value = "drain";
+    overflowArg.name = "Overflow policy";
+    overflowArg.description = "What to drop when the reader falls behind: new transfers and then the whole ring (drain), "
+                              "only new transfers (drop_newest) or the oldest queued transfers (drop_oldest).";
+    overflowArg.type = SoapySDR::ArgInfo::STRING;
+    overflowArg.options = {"drain", "drop_newest", "drop_oldest"};
+
+    streamArgs.push_back(overflowArg);
+
+    SoapySDR::ArgInfo squelchArg;
+    squelchArg.key = "squelch";
+    squelchArg.value = "";
+    squelchArg.name = "Squelch level";
+    squelchArg.description = "Only hand out buffers whose power exceeds this level (empty = stream everything).";
+    squelchArg.units = "dBFS";
+    squelchArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(squelchArg);
+
+    SoapySDR::ArgInfo hangtimeArg;
+    hangtimeArg.key = "hangtime";
+    hangtimeArg.value = "100";
+    hangtimeArg.name = "Squelch hang time";
+    hangtimeArg.description = "Keep the squelch open this long after the signal drops below the level.";
+    hangtimeArg.units = "ms";
+    hangtimeArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(hangtimeArg);
+
+    SoapySDR::ArgInfo squelchPreArg;
+    squelchPreArg.key = "squelchPre";
+    squelchPreArg.value = "1";
+    squelchPreArg.name = "Squelch pre-padding";
+    squelchPreArg.description = "Buffers handed out before the one that opened the squelch.";
+    squelchPreArg.units = "buffers";
+    squelchPreArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(squelchPreArg);
+
+    SoapySDR::ArgInfo squelchPostArg;
+    squelchPostArg.key = "squelchPost";
+    squelchPostArg.value = "1";
+    squelchPostArg.name = "Squelch post-padding";
+    squelchPostArg.description = "Buffers handed out after the hang time has run out.";
+    squelchPostArg.units = "buffers";
+    squelchPostArg.type = SoapySDR::ArgInfo::INT;
+
+    streamArgs.push_back(squelchPostArg);
+
+    SoapySDR::ArgInfo historyArg;
+    historyArg.key = "history";
+    historyArg.value = "0";
+    historyArg.name = "Lookback history";
+    historyArg.description = "Keep this many seconds of samples in memory for the 'trigger' setting.";
+    historyArg.units = "s";
+    historyArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(historyArg);
+
+    SoapySDR::ArgInfo latencyArg;
+    latencyArg.key = "latency";
+    latencyArg.value = "false";
+    latencyArg.name = "Latency measurement";
+    latencyArg.description = "Timestamp every USB transfer and measure how long it takes to come out of readStream, "
+                             "read the statistics with the 'latency' setting.";
+    latencyArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(latencyArg);
+
+    SoapySDR::ArgInfo statsArg;
+    statsArg.key = "stats";
+    statsArg.value = "false";
+    statsArg.name = "Signal statistics";
+    statsArg.description = "Measure RMS, peak, clipping and DC of every buffer while it's copied into the ring, "
+                           "read with the 'stats' and 'last_buffer_stats' settings.";
+    statsArg.type = SoapySDR::ArgInfo::BOOL;
+
+    streamArgs.push_back(statsArg);
+
+    SoapySDR::ArgInfo statsWindowArg;
+    statsWindowArg.key = "statsWindow";
+    statsWindowArg.value = "1000";
+    statsWindowArg.name = "Statistics window";
+    statsWindowArg.description = "Span the buffer statistics are summed over before they're published.";
+    statsWindowArg.units = "ms";
+    statsWindowArg.type = SoapySDR::ArgInfo::FLOAT;
+
+    streamArgs.push_back(statsWindowArg);
+
     return streamArgs;
 }
 
@@ -61,29 +194,272 @@ static void _rx_callback(unsigned char *buf, uint32_t len, void *ctx) {
 }
 
 void SoapyMiri::rx_async_operation(void) {
-    mirisdr_read_async(dev, &_rx_callback, this, optNumBuffers, optBufferLength);
+    if (_replay) {
+        this->replay_operation();
+    } else if (_simulated) {
+        this->simulate_operation();
+    } else {
+        mirisdr_read_async(dev, &_rx_callback, this, optNumBuffers, optBufferLength);
+    }
+    _rxRunning = false;
+}
+
+void SoapyMiri::replay_operation(void) {
+    // decoded as fast as the reader takes it: a full ring holds the replay back instead of dropping
+    std::vector<int16_t> samples;
+    unsigned long long tick = 0;
+    while (!_replayStop) {
+        if (_paused || _buf_count == optNumBuffers) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+
+        const size_t numElems = _replay->readBlock(_replayBlock++, samples, tick);
+        if (numElems == 0) {
+            SoapySDR_logf(SOAPY_SDR_INFO, "SoapyMiri replay finished");
+            break;
+        }
+
+        // the recording's sample counter carries over, including the gaps of blocks lost while recording
+        // (the stream's counter never runs backwards, so a seek back continues from where it was)
+        if (tick > _sampleTick) {
+            _sampleTick = tick;
+        }
+        this->rx_callback((unsigned char *) samples.data(), (uint32_t) (numElems * 2 * sizeof(int16_t)));
+    }
+}
+
+void SoapyMiri::simulate_operation(void) {
+    // one transfer of bufflen bytes per transfer period, like the dongle delivers them; a transfer
+    // that's due late (slow callback) is handed over late instead of skipped, as on the USB side
+    const size_t numElems = optBufferLength / BYTES_PER_SAMPLE / 2;
+    const auto period = std::chrono::nanoseconds((long long) (numElems * 1e9 / sampleRate));
+
+    // a tone at an eighth of the sample rate, -6 dBFS; transfers hold multiples of 8 samples
+    static const int16_t tone[8] = {16384, 11585, 0, -11585, -16384, -11585, 0, 11585};
+    std::vector<int16_t> samples(numElems * 2);
+    for (size_t i = 0; i < numElems; i++) {
+        samples[i * 2 + 0] = tone[i % 8];
+        samples[i * 2 + 1] = tone[(i + 6) % 8];
+    }
+
+    auto due = std::chrono::steady_clock::now();
+    while (!_replayStop) {
+        due += period;
+        std::this_thread::sleep_until(due);
+
+        // lost on the way (see 'simulate_drop'): the counter moves on, nothing arrives
+        if (_simulateDrop != 0) {
+            _simulateDrop--;
+            _sampleTick += numElems;
+            continue;
+        }
+
+        // the sample counter itself, 15 bits in I and the next 15 in Q, to check the timestamps
+        if (_simulateCounter) {
+            const unsigned long long tick = _sampleTick;
+            for (size_t i = 0; i < numElems; i++) {
+                samples[i * 2 + 0] = (int16_t) ((tick + i) & 0x7fff);
+                samples[i * 2 + 1] = (int16_t) (((tick + i) >> 15) & 0x7fff);
+            }
+        }
+        // the handover time in the first sample (steady_clock ns, 16 bits in each of the 4 components),
+        // so a reader can tell how long the transfer took to come out of readStream
+        if (_simulateMarker) {
+            const auto ns = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            for (size_t k = 0; k < 4; k++) {
+                samples[k] = (int16_t) (uint16_t) (ns >> (16 * k));
+            }
+        }
+        this->rx_callback((unsigned char *) samples.data(), (uint32_t) (numElems * 2 * sizeof(int16_t)));
+    }
+}
+
+void SoapyMiri::recordLoss(const unsigned long long tick, const size_t numElems) {
+    // caller holds _buf_mutex
+    if (_lossElems == 0 || tick < _lossIndex) {
+        _lossIndex = tick;
+    }
+    _lossElems += numElems;
+    _droppedSamples += numElems;
+
+    // kept in sample order: the drain policy flushes queued buffers older than the transfers
+    // it has already dropped; adjacent ranges are merged into one entry
+    auto next = std::upper_bound(_lossLog.begin(), _lossLog.end(), tick,
+                                 [](unsigned long long t, const std::pair<unsigned long long, unsigned long long> &loss) {
+                                     return t < loss.first;
+                                 });
+    if (next != _lossLog.begin() && std::prev(next)->first + std::prev(next)->second == tick) {
+        auto prev = std::prev(next);
+        prev->second += numElems;
+        if (next != _lossLog.end() && prev->first + prev->second == next->first) {
+            prev->second += next->second;
+            _lossLog.erase(next);
+        }
+        return;
+    }
+    if (next != _lossLog.end() && tick + numElems == next->first) {
+        next->first = tick;
+        next->second += numElems;
+        return;
+    }
+    _lossLog.emplace(next, tick, numElems);
+    if (_lossLog.size() > MAX_OVERFLOW_LOG) {
+        _lossLog.pop_front();
+    }
 }
 
 void SoapyMiri::rx_callback(unsigned char *buf, uint32_t len) {
+    // taken before anything else, the lock wait is part of the delivery latency
+    const auto arrival = optLatency ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    std::lock_guard<std::mutex> rxLock(_rx_mutex);
+
+    // the sample counter keeps running through drops and pauses, so gaps show up in the timestamps
+    size_t numElems = len / _wireBytesPerSample / 2;
+    unsigned long long tick = _sampleTick.fetch_add(numElems);
+    MIRI_TRACE(EVENT_CALLBACK, len);
+
+    if (_paused) {
+        return;
+    }
+
+    // lookback history, indexed by the sample counter so a window maps straight to timestamps
+    if (_historyElems != 0) {
+        // raised before the write, so a snapshot checking its window accounts for this one
+        if (numElems > _historyMaxWrite.load(std::memory_order_relaxed)) {
+            _historyMaxWrite = numElems;
+        }
+        const size_t pos = tick % _historyElems;
+        const size_t first = std::min(numElems, _historyElems - pos);
+        _unpack(buf, _history.data() + pos * 2, first, 0, nullptr);
+        if (first < numElems) {
+            _unpack(buf + first * _wireBytesPerSample * 2, _history.data(), numElems - first, 0, nullptr);
+        }
+        _historyWrite.store(tick + numElems, std::memory_order_release);
+    }
+
+    // timed activation and resume: nothing before the requested sample
+    const unsigned long long startTick = std::max<unsigned long long>(_activateTick, _discardBefore);
+    if (tick + numElems <= startTick) {
+        return;
+    }
+    if (tick < startTick) {
+        const size_t skip = startTick - tick;
+        buf += skip * _wireBytesPerSample * 2;
+        len -= skip * _wireBytesPerSample * 2;
+        numElems -= skip;
+        tick = startTick;
+    }
+
+    // the recorder gets every transfer that reaches the stream, also the ones the reader drops
+    if (_recorder) {
+        _recorder->push(tick, buf, numElems, _unpack);
+    }
+
+    // finite capture straight into the burst buffer, the ring isn't involved
+    if (_burstActive) {
+        const size_t fill = _burstFill;
+        if (fill == _burstElems) {
+            return;
+        }
+        if (fill == 0) {
+            _burstTick = tick;
+        }
+        const size_t count = std::min(numElems, _burstElems - fill);
+        MiriBufferStats stats;
+        if (optStats) {
+            _ingest(buf, _burst.data() + fill * 2, count, _clipLevel, &stats);
+            this->accumulateStats(tick, count, stats);
+        } else {
+            _unpack(buf, _burst.data() + fill * 2, count, 0, nullptr);
+        }
+        {
+            std::lock_guard<std::mutex> lock(_buf_mutex);
+            if (optStats) {
+                _burstStats.push_back({tick, count, stats});
+            }
+            _burstFill = fill + count;
+        }
+        _buf_cond.notify_one();
+
+        // capture complete: pause, and end the USB transfers (the simulation) rather than dropping
+        // them until the next activateStream; a replay already waits while paused
+        if (fill + count == _burstElems) {
+            _paused = true;
+            if (!_replay) {
+                _burstStopped = true;
+                if (dev) {
+                    mirisdr_cancel_async(dev);
+                } else {
+                    _replayStop = true;
+                }
+            }
+        }
+        return;
+    }
+
     // overflow condition: the caller is not reading fast enough
     if (_buf_count == optNumBuffers) {
+        std::lock_guard<std::mutex> lock(_buf_mutex);
         _overflowEvent = true;
-        return;
+        MIRI_TRACE(EVENT_OVERFLOW, tick);
+
+        // make room by dropping the oldest buffer the reader isn't holding
+        if (optOverflowPolicy == MIRI_OVERFLOW_DROP_OLDEST && _buf_count > _buf_held) {
+            const size_t oldest = _bufOrder[_buf_head];
+            recordLoss(buffs[oldest].tick, buffs[oldest].data.size() / BYTES_PER_SAMPLE / 2);
+
+            // the held buffers sit between the tail and the head: move their ring positions up by
+            // one and refill the dropped buffer in place at the tail, no buffer memory moves, so
+            // handles and direct access pointers the reader holds stay valid
+            size_t pos = _buf_head;
+            for (size_t i = 0; i < _buf_held; i++) {
+                const size_t prev = (pos + optNumBuffers - 1) % optNumBuffers;
+                _bufOrder[pos] = _bufOrder[prev];
+                pos = prev;
+            }
+            _bufOrder[pos] = oldest;
+            _buf_head = (_buf_head + 1) % optNumBuffers;
+            _buf_count--;
+        } else {
+            recordLoss(tick, numElems);
+            return;
+        }
     }
 
     // copy into the buffer queue
-    auto &buff = buffs[_buf_tail];
-    // buff.tick = tick;
-    buff.data.resize(len);
-    std::memcpy(buff.data.data(), buf, len);
+    auto &buff = buffs[_bufOrder[_buf_tail]];
+    buff.tick = tick;
+    buff.arrival = arrival;
+    buff.data.resize(numElems * BYTES_PER_SAMPLE * 2);
+    if (_wireBytesPerSample == BYTES_PER_SAMPLE && !optSquelch && !optStats) {
+        std::memcpy(buff.data.data(), buf, len);
+    } else {
+        _ingest(buf, (int16_t *) buff.data.data(), numElems, _clipLevel, &buff.stats);
+    }
+
+    if (optStats) {
+        this->accumulateStats(tick, numElems, buff.stats);
+    }
+
+    // in the stream format for direct access, once that is in use
+    buff.convertedValid = false;
+    if (_rxConvert) {
+        this->convertBuffer(buff);
+    }
 
     // increment the tail pointer
+    MIRI_TRACE(EVENT_RING_PUBLISH, _bufOrder[_buf_tail]);
     _buf_tail = (_buf_tail + 1) % optNumBuffers;
 
     // increment buffers available under lock to avoid race in acquireReadBuffer wait
     {
         std::lock_guard<std::mutex> lock(_buf_mutex);
         _buf_count++;
+        if (optSquelch) {
+            this->gateBuffers();
+        }
     }
 
     // notify readStream()
@@ -101,25 +477,39 @@ SoapySDR::Stream *SoapyMiri::setupStream(
         const SoapySDR::Kwargs &args
 ) {
 
-    if (!dev) {
+    if (!dev && !_replay && !_simulated) {
         throw std::runtime_error("Trying to setupStream without an initialized MiriSDR!");
     }
 
+    // the ring and the wire format are about to change under the rx thread
+    this->stopRxThread();
+
     if (direction != SOAPY_SDR_RX) {
         throw std::runtime_error("LibMiriSDR supports only RX.");
     }
 
-    if (channels.size() > 1 || (channels.size() > 0 && channels.at(0) != 0)) {
-        throw std::runtime_error("setupStream invalid channel selection");
+    std::vector<size_t> streamChannels = channels;
+    if (streamChannels.empty()) {
+        streamChannels.push_back(0);
+    }
+    for (const auto channel : streamChannels) {
+        if (channel >= getNumChannels(SOAPY_SDR_RX)) {
+            throw std::runtime_error("setupStream invalid channel selection");
+        }
     }
 
     if (format == SOAPY_SDR_CS16) {
         sampleFormat = MIRI_FORMAT_CS16;
+        _elemSize = sizeof(int16_t) * 2;
         SoapySDR_logf(SOAPY_SDR_WARNING, "SoapyMiri: CS16 format is untested!");
     } else if (format == SOAPY_SDR_CF32) {
         sampleFormat = MIRI_FORMAT_CF32;
+        _elemSize = sizeof(float) * 2;
+    } else if (format == SOAPY_SDR_CS8) {
+        sampleFormat = MIRI_FORMAT_CS8;
+        _elemSize = sizeof(int8_t) * 2;
     } else {
-        throw std::runtime_error("setupStream: invalid format '" + format + "', only CS16 and CF32 is supported by SoapyMiri.");
+        throw std::runtime_error("setupStream: invalid format '" + format + "', only CS16, CF32 and CS8 are supported by SoapyMiri.");
     }
 
     optBufferLength = DEFAULT_BUFFER_LENGTH;
@@ -146,27 +536,221 @@ SoapySDR::Stream *SoapyMiri::setupStream(
     }
     SoapySDR_logf(SOAPY_SDR_DEBUG, "SoapyMiri Using %d buffers", optNumBuffers);
 
+    optFillRead = false;
+    if (args.count("fillRead") != 0) {
+        optFillRead = (args.at("fillRead") == "true");
+    }
+
+    optOverflowPolicy = MIRI_OVERFLOW_DRAIN;
+    if (args.count("overflow") != 0) {
+        const std::string &policy = args.at("overflow");
+        if (policy == "drop_newest") {
+            optOverflowPolicy = MIRI_OVERFLOW_DROP_NEWEST;
+        } else if (policy == "drop_oldest") {
+            optOverflowPolicy = MIRI_OVERFLOW_DROP_OLDEST;
+        } else if (policy != "drain") {
+            throw std::runtime_error("setupStream: invalid overflow policy '" + policy + "'");
+        }
+    }
+
+    optScale = 1.0f;
+    if (args.count("scale") != 0) {
+        try {
+            optScale = std::stof(args.at("scale"));
+        }
+        catch (const std::invalid_argument &) {}
+    }
+
+    optStats = args.count("stats") != 0 && args.at("stats") == "true";
+    double statsWindowMs = 1000;
+    if (args.count("statsWindow") != 0) {
+        try {
+            statsWindowMs = std::stod(args.at("statsWindow"));
+        }
+        catch (const std::invalid_argument &) {}
+    }
+    optStatsWindowElems = std::max<unsigned long long>(1, (unsigned long long) (statsWindowMs * 1e-3 * sampleRate));
+    _statsAccum = MiriStatsWindow();
+    _statsWindow.update([](MiriStatsWindow &window) { window = MiriStatsWindow(); });
+    _lastBufferStats.update([](MiriStatsWindow &window) { window = MiriStatsWindow(); });
+
+    optLatency = args.count("latency") != 0 && args.at("latency") == "true";
+    {
+        std::lock_guard<std::mutex> lock(_latencyMutex);
+        _latencyUs.clear();
+        _latencyNext = 0;
+    }
+
+    optDCRemoval = args.count("dcRemoval") != 0 && args.at("dcRemoval") == "true";
+    optPower = args.count("power") != 0 && args.at("power") == "true";
+
+    // the kernel is fixed for the lifetime of the stream, no per-call format dispatch
+    _convert = miriSelectConverter(sampleFormat, optDCRemoval, optPower, optScale, _convertState);
+
+    // direct access hands out the stream format: once it is used, anything but a plain copy runs on
+    // the rx thread into the buffers' converted halves (see startRxConvert), until then readStream converts
+    _rxConvertFormat = (_convert != &miriConvertCopy) || channelizerBins != 0;
+    _rxConvert = false;
+
+    // the channelizer replaces the conversion kernel and decimates by the number of bins
+    _channelizer.reset();
+    if (channelizerBins != 0) {
+        if (sampleFormat != MIRI_FORMAT_CF32) {
+            throw std::runtime_error("setupStream: the channelizer only produces CF32");
+        }
+        if ((optBufferLength / BYTES_PER_SAMPLE / 2) % channelizerBins != 0) {
+            throw std::runtime_error("setupStream: bufflen must hold a multiple of the channelizer's channels");
+        }
+        std::vector<size_t> bins;
+        for (const auto channel : streamChannels) {
+            bins.push_back(channelBin(channel));
+        }
+        _channelizer.reset(new MiriChannelizer(channelizerBins, bins));
+    }
+    _streamChannels = streamChannels;
+    _channelTargets.assign(streamChannels.size(), nullptr);
+    _rxChannelTargets.assign(streamChannels.size(), nullptr);
+    _binsChanged = false;
+    {
+        std::lock_guard<std::mutex> lock(_powerMutex);
+        _powerSum = 0;
+        _powerCount = 0;
+    }
+
+    optSquelch = false;
+    if (args.count("squelch") != 0 && !args.at("squelch").empty()) {
+        try {
+            optSquelchLevel = std::pow(10.0f, std::stof(args.at("squelch")) / 10.0f);
+            optSquelch = true;
+        }
+        catch (const std::invalid_argument &) {}
+    }
+
+    double hangtimeMs = 100;
+    if (args.count("hangtime") != 0) {
+        try {
+            hangtimeMs = std::stod(args.at("hangtime"));
+        }
+        catch (const std::invalid_argument &) {}
+    }
+    optHangSamples = (unsigned long long) (hangtimeMs * 1e-3 * sampleRate);
+
+    // pre-padding is kept in the ring, leave room for the reader and the rx thread
+    optSquelchPre = 1;
+    optSquelchPost = 1;
+    try {
+        if (args.count("squelchPre") != 0) {
+            optSquelchPre = (size_t) std::max(0, std::stoi(args.at("squelchPre")));
+        }
+        if (args.count("squelchPost") != 0) {
+            optSquelchPost = (size_t) std::max(0, std::stoi(args.at("squelchPost")));
+        }
+    }
+    catch (const std::invalid_argument &) {}
+    optSquelchPre = std::min(optSquelchPre, optNumBuffers > 2 ? optNumBuffers - 2 : 0);
+
+    // one slab for the whole history, allocated here and never resized while streaming
+    double historySeconds = 0;
+    if (args.count("history") != 0) {
+        try {
+            historySeconds = std::stod(args.at("history"));
+        }
+        catch (const std::invalid_argument &) {}
+    }
+    _historyElems = 0;
+    if (historySeconds > 0) {
+        _historyElems = std::max((size_t) (historySeconds * sampleRate), 2 * optBufferLength);
+        _history.assign(_historyElems * 2, 0);
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "SoapyMiri lookback history of %zu samples", _historyElems);
+    } else {
+        _history.clear();
+        _history.shrink_to_fit();
+    }
+    _historyWrite = 0;
+    _historyMaxWrite = 0;
+
+    _replayBlock = 0;
+    _burstStopped = false;
+
     // clear async fifo counts
     _buf_tail = 0;
     _buf_count = 0;
     _buf_head = 0;
+    _buf_held = 0;
+    _gateHangUntil = 0;
+    _gatePostLeft = 0;
+    {
+        std::lock_guard<std::mutex> lock(_buf_mutex);
+        _droppedSamples = 0;
+        _lossElems = 0;
+        _lastLossIndex = 0;
+        _lastLossElems = 0;
+        _lossLog.clear();
+    }
 
     // allocate buffers
     buffs.resize(optNumBuffers);
+    _bufOrder.resize(optNumBuffers);
+    for (size_t i = 0; i < optNumBuffers; i++) {
+        _bufOrder[i] = i;
+    }
     for (auto &buff : buffs) {
-        buff.data.reserve(optBufferLength);
         buff.data.resize(optBufferLength);
+        buff.converted.clear();
+        buff.convertedValid = false;
     }
+    updateWireFormat();
 
     return (SoapySDR::Stream *) this;
 }
 
+int32_t SoapyMiri::wireClipLevel(void) const {
+    // samples are left aligned in the int16 range, so the top code of an N-bit ADC is 2^(16-N) below full scale
+    const int adcBits = (_replay || _simulated) ? 16 : getWireFormat().bits;
+    return 32768 - (1 << (16 - adcBits));
+}
+
+void SoapyMiri::updateWireFormat(void) {
+    // the sample format can change between setupStream and the start of the rx thread,
+    // so this runs again on every start; the caller makes sure no callback is running
+
+    // 8-bit wire samples are unpacked into the int16 ring by the rx thread, a replay or simulation is already int16
+    _wireBytesPerSample = (_replay || _simulated) ? BYTES_PER_SAMPLE : getWireFormat().bytesPerSample;
+    _ingest = miriSelectIngest(_wireBytesPerSample,
+                               optStats ? MIRI_MEASURE_ALL : optSquelch ? MIRI_MEASURE_POWER : MIRI_MEASURE_NONE);
+    _unpack = miriSelectIngest(_wireBytesPerSample, MIRI_MEASURE_NONE);
+    _clipLevel = wireClipLevel();
+
+    _segmentElems = optBufferLength / _wireBytesPerSample / 2 / (_channelizer ? _channelizer->numBins() : 1);
+    for (auto &buff : buffs) {
+        buff.data.reserve(optBufferLength * BYTES_PER_SAMPLE / _wireBytesPerSample);
+        if (_rxConvertFormat) {
+            buff.converted.reserve(_segmentElems * _streamChannels.size() * _elemSize);
+        }
+    }
+}
+
 void SoapyMiri::closeStream(SoapySDR::Stream *stream) {
-    this->deactivateStream(stream, 0, 0);
+    this->stopRxThread();
+
+    // the snapshot reads out of the history slab
+    _snapshotAbort = true;
+    if (_snapshotThread.joinable()) {
+        _snapshotThread.join();
+    }
+    _historyElems = 0;
+    {
+        std::lock_guard<std::mutex> lock(_snapshotMutex);
+        _snapshots.clear();
+    }
+
     buffs.clear();
 }
 
 size_t SoapyMiri::getStreamMTU(SoapySDR::Stream *stream) const {
+    if (_channelizer) {
+        return optBufferLength / BYTES_PER_SAMPLE / _channelizer->numBins();
+    }
     return optBufferLength / BYTES_PER_SAMPLE;
 }
 
@@ -176,14 +760,80 @@ int SoapyMiri::activateStream(
         const long long timeNs,
         const size_t numElems
 ) {
-    if (!dev)
+    if (!dev && !_replay && !_simulated)
         return 0;
 
+    const bool burst = (flags & SOAPY_SDR_END_BURST) != 0 && numElems != 0;
+    if (burst && _channelizer) {
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+
+    // a completed burst cancelled the transfers, let the rx thread wind down (its last callbacks take _rx_mutex)
+    if (_burstStopped) {
+        this->stopRxThread();
+    }
+
+    // no callback runs while the stream state changes
+    std::lock_guard<std::mutex> rxLock(_rx_mutex);
+
+    // the rx thread ended on its own (USB error), start it over
+    if (_rx_async_thread.joinable() && !_rxRunning) {
+        _rx_async_thread.join();
+    }
+
+    // a sample format written while the rx thread was stopped takes effect here
+    if (!_rx_async_thread.joinable()) {
+        updateWireFormat();
+    }
+
+    _burstActive = false;
+    if (burst) {
+        // preallocated up front, the rx thread only copies into it
+        _burst.resize(numElems * 2);
+        _burstElems = numElems;
+        _burstFill = 0;
+        _burstRead = 0;
+        _burstStats.clear();
+        _burstStats.reserve(numElems / (optBufferLength / _wireBytesPerSample / 2) + 2);
+        _burstStatsNext = 0;
+        _burstActive = true;
+    }
+
     resetBuffer = true;
     remainingElems = 0;
+    _nextTickValid = false;
+    _acquireNextTickValid = false;
 
-    if (!_rx_async_thread.joinable()) {
-        mirisdr_reset_buffer(dev);
+    const bool start = !_rx_async_thread.joinable();
+    // after a burst the counter carries on from where the transfers stopped
+    const bool keepCounter = start && _burstStopped;
+    _burstStopped = false;
+    if (start && !keepCounter) {
+        _sampleTick = 0;
+        _discardBefore = 0;
+    } else if (!start) {
+        // resuming: the transfers in flight still carry samples from the pause
+        _discardBefore = this->cleanTick();
+    }
+
+    // timed activation: timeNs is on the absolute timebase of getHardwareTime, the sample counter
+    // started by the first activateStream after setupStream, which keeps counting through
+    // deactivate/activate; it is not relative to this activation
+    _activateTick = (flags & SOAPY_SDR_HAS_TIME) ? this->timeNsToTicks(timeNs) : 0;
+    if ((flags & SOAPY_SDR_HAS_TIME) && (!start || keepCounter) && _activateTick < _sampleTick) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "SoapyMiri activateStream: time %lld ns has already passed (hardware time %lld ns), "
+                      "streaming from now", timeNs, this->ticksToTimeNs(_sampleTick));
+    }
+
+    _activateTime = std::chrono::steady_clock::now();
+    _firstSamplePending = true;
+    _paused = false;
+
+    if (start) {
+        if (dev) {
+            mirisdr_reset_buffer(dev);
+        }
+        _rxRunning = true;
         _rx_async_thread = std::thread(&SoapyMiri::rx_async_operation, this);
     }
 
@@ -191,14 +841,139 @@ int SoapyMiri::activateStream(
 }
 
 int SoapyMiri::deactivateStream(SoapySDR::Stream *stream, const int flags, const long long timeNs) {
-    if (!dev)
+    if (!dev && !_replay && !_simulated)
         return 0;
 
+    // the USB transfers keep going, the rx thread just drops everything until the next activateStream
+    std::lock_guard<std::mutex> rxLock(_rx_mutex);
+    _paused = true;
+    return 0;
+}
+
+void SoapyMiri::stopRxThread(void) {
+    _paused = true;
     if (_rx_async_thread.joinable()) {
-        mirisdr_cancel_async(dev);
+        if (dev) {
+            mirisdr_cancel_async(dev);
+        }
+        _replayStop = true;
         _rx_async_thread.join();
+        _replayStop = false;
     }
-    return 0;
+}
+
+void SoapyMiri::markFirstSample(void) {
+    if (_firstSamplePending) {
+        _firstSamplePending = false;
+        _activateLatencyUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - _activateTime).count();
+    }
+}
+
+void SoapyMiri::recordLatency(const std::chrono::steady_clock::time_point &arrival) {
+    const float latencyUs = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - arrival).count();
+
+    std::lock_guard<std::mutex> lock(_latencyMutex);
+    if (_latencyUs.size() < LATENCY_WINDOW) {
+        _latencyUs.push_back(latencyUs);
+    } else {
+        _latencyUs[_latencyNext] = latencyUs;
+    }
+    _latencyNext = (_latencyNext + 1) % LATENCY_WINDOW;
+}
+
+std::string SoapyMiri::latencyStatus(void) const {
+    std::vector<float> sorted;
+    {
+        std::lock_guard<std::mutex> lock(_latencyMutex);
+        sorted = _latencyUs;
+    }
+    if (sorted.empty()) {
+        return "";
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0, sumSquares = 0;
+    for (const auto latency : sorted) {
+        sum += latency;
+        sumSquares += (double) latency * latency;
+    }
+    const double mean = sum / sorted.size();
+    auto percentile = [&sorted](double p) {
+        return std::to_string(sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))]);
+    };
+
+    // microseconds; jitter is the standard deviation
+    SoapySDR::Kwargs status;
+    status["buffers"] = std::to_string(sorted.size());
+    status["mean_us"] = std::to_string(mean);
+    status["p50_us"] = percentile(0.5);
+    status["p99_us"] = percentile(0.99);
+    status["p999_us"] = percentile(0.999);
+    status["max_us"] = std::to_string(sorted.back());
+    status["jitter_us"] = std::to_string(std::sqrt(std::max(0.0, sumSquares / sorted.size() - mean * mean)));
+    return SoapySDR::KwargsToString(status);
+}
+
+void SoapyMiri::addStats(MiriStatsWindow &window, unsigned long long tick, size_t numElems, const MiriBufferStats &stats) {
+    if (window.numElems == 0) {
+        window.startTick = tick;
+    }
+    window.numElems += numElems;
+    window.powerSum += (double) stats.power * numElems;
+    window.dcISum += (double) stats.dcI * numElems;
+    window.dcQSum += (double) stats.dcQ * numElems;
+    window.peak = std::max(window.peak, stats.peak);
+    window.clipped += stats.clipped;
+}
+
+void SoapyMiri::accumulateStats(unsigned long long tick, size_t numElems, const MiriBufferStats &stats) {
+    // the window is cut at the first buffer past its length, so it always holds whole buffers
+    addStats(_statsAccum, tick, numElems, stats);
+    if (_statsAccum.numElems >= optStatsWindowElems) {
+        const MiriStatsWindow window = _statsAccum;
+        _statsWindow.update([&window](MiriStatsWindow &published) { published = window; });
+        _statsAccum = MiriStatsWindow();
+    }
+}
+
+std::string SoapyMiri::statsValue(const MiriStatsWindow &window, const std::string &key) const {
+    if (window.numElems == 0) {
+        return "";
+    }
+
+    // levels in dBFS, DC relative to full scale
+    const double samples = (double) window.numElems;
+    if (key == "start_index") {
+        return std::to_string(window.startTick);
+    } else if (key == "start_time_ns") {
+        return std::to_string(this->ticksToTimeNs(window.startTick));
+    } else if (key == "samples") {
+        return std::to_string(window.numElems);
+    } else if (key == "rms_dbfs") {
+        return std::to_string(10.0 * std::log10(window.powerSum / samples + 1e-20));
+    } else if (key == "peak_dbfs") {
+        return std::to_string(20.0 * std::log10(window.peak + 1e-10));
+    } else if (key == "clip_count") {
+        return std::to_string(window.clipped);
+    } else if (key == "dc_i") {
+        return std::to_string(window.dcISum / samples);
+    } else if (key == "dc_q") {
+        return std::to_string(window.dcQSum / samples);
+    }
+    return "";
+}
+
+std::string SoapyMiri::statsToString(const MiriStatsWindow &window) const {
+    if (window.numElems == 0) {
+        return "";
+    }
+
+    SoapySDR::Kwargs stats;
+    for (const char *key : {"start_index", "start_time_ns", "samples", "rms_dbfs", "peak_dbfs", "clip_count", "dc_i", "dc_q"}) {
+        stats[key] = statsValue(window, key);
+    }
+    return SoapySDR::KwargsToString(stats);
 }
 
 int SoapyMiri::readStream(
@@ -215,35 +990,145 @@ int SoapyMiri::readStream(
         this->releaseReadBuffer(stream, _currentHandle);
     }
 
-    // this is the user's buffer for channel 0
-    void *buff0 = buffs[0];
+    if (_burstActive) {
+        return this->readBurst(buffs, numElems, flags, timeNs, timeoutUs);
+    }
+
+    if (!optFillRead) {
+        return this->readFragment(stream, buffs, 0, numElems, flags, timeNs, timeoutUs, false);
+    }
+
+    // fill mode: keep pulling ring buffers until the request is satisfied or the timeout expires
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+    size_t totalElems = 0;
+    while (totalElems < numElems) {
+        long remainingUs = 0;
+        if (totalElems == 0 || remainingElems == 0) {
+            auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+            remainingUs = std::max<long>(0, (long) left.count());
+        }
+
+        int fragFlags = 0;
+        long long fragTimeNs = 0;
+        int ret = this->readFragment(stream, buffs, totalElems, numElems - totalElems,
+                                     fragFlags, fragTimeNs, remainingUs, totalElems != 0);
+
+        if (ret < 0) {
+            // errors are only reported when nothing was read, a drop after some samples shows up
+            // as a discontinuity (SOAPY_SDR_END_ABRUPT) on the next call instead
+            if (totalElems == 0) {
+                return ret;
+            }
+            break;
+        }
+
+        if (totalElems == 0) {
+            flags = fragFlags;
+            timeNs = fragTimeNs;
+        }
+
+        // 0 = the next buffer is not contiguous, leave it for the next call
+        if (ret == 0) {
+            break;
+        }
+        totalElems += ret;
+    }
+
+    flags &= ~SOAPY_SDR_MORE_FRAGMENTS;
+    if (remainingElems != 0) {
+        flags |= SOAPY_SDR_MORE_FRAGMENTS;
+    }
+
+    return totalElems;
+}
 
+int SoapyMiri::readFragment(
+        SoapySDR::Stream *stream,
+        void *const *outs,
+        const size_t outOffset,
+        const size_t numElems,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs,
+        const bool stopAtGap
+) {
     // are elements left in the buffer? if not, do a new read.
+    bool fresh = false;
     if (remainingElems == 0) {
-        int ret = this->acquireReadBuffer(stream, _currentHandle, (const void **) &_currentBuff, flags, timeNs, timeoutUs);
+        int ret = this->acquireBuffer(_currentHandle, flags, timeNs, timeoutUs);
         if (ret < 0) {
             return ret;
         }
         remainingElems = ret;
+        _currentOffset = 0;
+        _currentTick = _acquiredTick;
+        _currentArrival = _acquiredArrival;
+        fresh = true;
+    }
+
+    // a gap (drop, flush) between the previous and this buffer
+    const bool discontinuity = _nextTickValid && _currentTick != _nextTick;
+    if (discontinuity && stopAtGap) {
+        return 0;
     }
 
-    size_t returnedElems = std::min(remainingElems, numElems);
+    // the channelizer consumes whole blocks of input per output sample
+    const size_t decimation = _channelizer ? _channelizer->numBins() : 1;
+    const size_t consumedElems = std::min(remainingElems, numElems * decimation) / decimation * decimation;
+    const size_t returnedElems = consumedElems / decimation;
 
-    // convert into user's buff0
-    if (sampleFormat == MIRI_FORMAT_CS16) {
-        std::memcpy(buff0, _currentBuff, sizeof(int16_t) * 2 * returnedElems);
-    } else if (sampleFormat == MIRI_FORMAT_CF32) {
-        float *ftarget = (float *) buff0;
-        for (size_t i = 0; i < returnedElems; i++) {
-            ftarget[i * 2 + 0] = ((float) _currentBuff[i * 2 + 0]) * (1.0f / 32768.0f);
-            ftarget[i * 2 + 1] = ((float) _currentBuff[i * 2 + 1]) * (1.0f / 32768.0f);
+    // convert into user's buffers
+    const Buffer &buff = buffs[_currentHandle];
+    const int16_t *in = (const int16_t *) buff.data.data() + _currentOffset * 2;
+    MIRI_TRACE(EVENT_CONVERT_BEGIN, returnedElems);
+    if (buff.convertedValid) {
+        // already in the stream format, a segment per channel
+        const size_t segmentElems = std::max(_segmentElems, buff.data.size() / BYTES_PER_SAMPLE / 2 / decimation);
+        for (size_t c = 0; c < (_channelizer ? _streamChannels.size() : 1); c++) {
+            std::memcpy((char *) outs[c] + outOffset * _elemSize,
+                        buff.converted.data() + (c * segmentElems + _currentOffset / decimation) * _elemSize,
+                        returnedElems * _elemSize);
+        }
+    } else if (_channelizer) {
+        if (_binsChanged) {
+            std::lock_guard<std::mutex> lock(_binsMutex);
+            _channelizer->setBins(_pendingBins);
+            _binsChanged = false;
+        }
+        for (size_t c = 0; c < _channelTargets.size(); c++) {
+            _channelTargets[c] = (float *) outs[c] + outOffset * 2;
         }
+        _channelizer->process(in, consumedElems, _channelTargets.data(), optScale / 32768.0f);
+    } else {
+        _convert(in, (char *) outs[0] + outOffset * _elemSize, returnedElems, _convertState);
+    }
+    MIRI_TRACE(EVENT_CONVERT_END, returnedElems);
+
+    // the first samples of the transfer are in the caller's buffer now
+    if (optLatency && fresh) {
+        this->recordLatency(_currentArrival);
+    }
+
+    if (optPower && !buff.convertedValid) {
+        std::lock_guard<std::mutex> lock(_powerMutex);
+        _powerSum += _convertState.powerSum;
+        _powerCount += _convertState.powerCount;
+        _convertState.powerSum = 0;
+        _convertState.powerCount = 0;
+    }
+
+    flags = SOAPY_SDR_HAS_TIME;
+    if (discontinuity) {
+        flags |= SOAPY_SDR_END_ABRUPT;
     }
+    timeNs = this->ticksToTimeNs(_currentTick);
 
     // bump variables for next call into readStream
-    remainingElems -= returnedElems;
-    // BYTES_PER_SAMPLE is handled by _currentBuff being int16_t*, only account for I/Q.
-    _currentBuff += returnedElems * 2;
+    remainingElems -= consumedElems;
+    _currentOffset += consumedElems;
+    _currentTick += consumedElems;
+    _nextTick = _currentTick;
+    _nextTickValid = true;
 
     if (remainingElems != 0) {
         flags |= SOAPY_SDR_MORE_FRAGMENTS;
@@ -251,10 +1136,107 @@ int SoapyMiri::readStream(
         this->releaseReadBuffer(stream, _currentHandle);
     }
 
-    // return number of elements written to buff0
+    // return number of elements written to each output
     return returnedElems;
 }
 
+int SoapyMiri::readBurst(
+        void *const *buffs,
+        const size_t numElems,
+        int &flags,
+        long long &timeNs,
+        const long timeoutUs
+) {
+    // the whole capture has been handed out
+    if (_burstRead == _burstElems) {
+        return SOAPY_SDR_TIMEOUT;
+    }
+
+    if (_burstFill == _burstRead) {
+        std::unique_lock<std::mutex> lock(_buf_mutex);
+        _buf_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this] { return _burstFill != _burstRead; });
+        if (_burstFill == _burstRead) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+    }
+
+    markFirstSample();
+    const size_t returnedElems = std::min(numElems, _burstFill - _burstRead);
+    _convert(_burst.data() + _burstRead * 2, buffs[0], returnedElems, _convertState);
+
+    // the transfers the samples handed out came from, as 'last_buffer_stats'
+    if (optStats) {
+        const unsigned long long begin = _burstTick + _burstRead;
+        const unsigned long long end = begin + returnedElems;
+        MiriStatsWindow current = MiriStatsWindow();
+        {
+            std::lock_guard<std::mutex> lock(_buf_mutex);
+            while (_burstStatsNext < _burstStats.size() &&
+                   _burstStats[_burstStatsNext].tick + _burstStats[_burstStatsNext].numElems <= begin) {
+                _burstStatsNext++;
+            }
+            for (size_t i = _burstStatsNext; i < _burstStats.size() && _burstStats[i].tick < end; i++) {
+                addStats(current, _burstStats[i].tick, _burstStats[i].numElems, _burstStats[i].stats);
+            }
+        }
+        _lastBufferStats.update([&current](MiriStatsWindow &published) { published = current; });
+    }
+
+    flags = SOAPY_SDR_HAS_TIME;
+    timeNs = this->ticksToTimeNs(_burstTick + _burstRead);
+    _burstRead += returnedElems;
+    if (_burstRead == _burstElems) {
+        flags |= SOAPY_SDR_END_BURST;
+    }
+
+    return returnedElems;
+}
+
+unsigned long long SoapyMiri::cleanTick(void) const {
+    // past every USB transfer libmirisdr keeps in flight, any of them may already hold samples from
+    // before now; the simulation models the same queue, a replay has nothing in flight
+    if (_replay) {
+        return _sampleTick;
+    }
+    return _sampleTick + optNumBuffers * (optBufferLength / _wireBytesPerSample / 2);
+}
+
+long long SoapyMiri::ticksToTimeNs(const unsigned long long ticks) const {
+    if (sampleRate <= 0) {
+        return 0;
+    }
+
+    // split into whole seconds first to keep the nanoseconds exact for long captures
+    const auto rate = (unsigned long long) sampleRate;
+    const unsigned long long full = ticks / rate;
+    const unsigned long long rem = ticks - full * rate;
+    return (long long) (full * 1000000000ULL) + std::llround(rem * 1e9 / sampleRate);
+}
+
+unsigned long long SoapyMiri::timeNsToTicks(const long long timeNs) const {
+    if (timeNs <= 0 || sampleRate <= 0) {
+        return 0;
+    }
+
+    const unsigned long long full = (unsigned long long) timeNs / 1000000000ULL;
+    const unsigned long long rem = (unsigned long long) timeNs - full * 1000000000ULL;
+    return full * (unsigned long long) sampleRate + (unsigned long long) std::llround(rem * sampleRate / 1e9);
+}
+
+/*******************************************************************
+ * Time API
+ ******************************************************************/
+
+bool SoapyMiri::hasHardwareTime(const std::string &what) const {
+    return what.empty();
+}
+
+long long SoapyMiri::getHardwareTime(const std::string &what) const {
+    // the stream's sample counter: starts at 0 with the first activateStream after setupStream
+    // (or after the rx thread ended on a USB error), keeps counting through deactivateStream
+    return this->ticksToTimeNs(_sampleTick);
+}
+
 /*******************************************************************
  * Direct buffer access API
  ******************************************************************/
@@ -264,7 +1246,16 @@ size_t SoapyMiri::getNumDirectAccessBuffers(SoapySDR::Stream *stream) {
 }
 
 int SoapyMiri::getDirectAccessBufferAddrs(SoapySDR::Stream *stream, const size_t handle, void **outBuffs) {
-    outBuffs[0] = (void *) buffs[handle].data.data();
+    // the stream format as set up (a segment per channel with the channelizer); the raw CS16 samples
+    // only when that is what the stream delivers
+    this->startRxConvert();
+    if (!_rxConvert) {
+        outBuffs[0] = (void *) buffs[handle].data.data();
+        return 0;
+    }
+    for (size_t c = 0; c < (_channelizer ? _streamChannels.size() : 1); c++) {
+        outBuffs[c] = (void *) (buffs[handle].converted.data() + c * _segmentElems * _elemSize);
+    }
     return 0;
 }
 
@@ -276,43 +1267,374 @@ int SoapyMiri::acquireReadBuffer(
         long long &timeNs,
         const long timeoutUs
 ) {
+    // direct access hands out the stream format from here on
+    this->startRxConvert();
+
+    const int ret = this->acquireBuffer(handle, flags, timeNs, timeoutUs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    const Buffer &buff = buffs[handle];
+    if (!buff.convertedValid) {
+        outBuffs[0] = (const void *) buff.data.data();
+        return ret;
+    }
+
+    // the channelizer's outputs are decimated, one segment per channel
+    const size_t decimation = _channelizer ? _channelizer->numBins() : 1;
+    const size_t segmentElems = std::max(_segmentElems, (size_t) ret / decimation);
+    for (size_t c = 0; c < (_channelizer ? _streamChannels.size() : 1); c++) {
+        outBuffs[c] = (const void *) (buff.converted.data() + c * segmentElems * _elemSize);
+    }
+    return ret / decimation;
+}
+
+void SoapyMiri::startRxConvert(void) {
+    if (!_rxConvertFormat || _rxConvert) {
+        return;
+    }
+
+    // the rx thread waits while the queued buffers are converted in order; a readStream fragment in
+    // progress is dropped, converting its rest now would put the converter state out of order
+    std::lock_guard<std::mutex> rxLock(_rx_mutex);
+    if (remainingElems != 0) {
+        remainingElems = 0;
+        this->releaseReadBuffer(nullptr, _currentHandle);
+    }
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    const size_t queued = _buf_count - _buf_held;
+    for (size_t i = 0; i < queued; i++) {
+        this->convertBuffer(buffs[_bufOrder[(_buf_head + i) % optNumBuffers]]);
+    }
+    _rxConvert = true;
+}
+
+void SoapyMiri::convertBuffer(Buffer &buff) {
+    // caller holds _rx_mutex
+    const size_t numElems = buff.data.size() / BYTES_PER_SAMPLE / 2;
+    MIRI_TRACE(EVENT_CONVERT_BEGIN, numElems);
+    if (_channelizer) {
+        if (_binsChanged) {
+            std::lock_guard<std::mutex> lock(_binsMutex);
+            _channelizer->setBins(_pendingBins);
+            _binsChanged = false;
+        }
+        const size_t decimation = _channelizer->numBins();
+        const size_t segmentElems = std::max(_segmentElems, numElems / decimation);
+        buff.converted.resize(_rxChannelTargets.size() * segmentElems * _elemSize);
+        for (size_t c = 0; c < _rxChannelTargets.size(); c++) {
+            _rxChannelTargets[c] = (float *) (buff.converted.data() + c * segmentElems * _elemSize);
+        }
+        _channelizer->process((const int16_t *) buff.data.data(), numElems / decimation * decimation,
+                              _rxChannelTargets.data(), optScale / 32768.0f);
+    } else {
+        buff.converted.resize(numElems * _elemSize);
+        _convert((const int16_t *) buff.data.data(), buff.converted.data(), numElems, _convertState);
+    }
+    MIRI_TRACE(EVENT_CONVERT_END, numElems);
+
+    if (optPower) {
+        std::lock_guard<std::mutex> lock(_powerMutex);
+        _powerSum += _convertState.powerSum;
+        _powerCount += _convertState.powerCount;
+        _convertState.powerSum = 0;
+        _convertState.powerCount = 0;
+    }
+    buff.convertedValid = true;
+}
+
+int SoapyMiri::acquireBuffer(size_t &handle, int &flags, long long &timeNs, const long timeoutUs) {
     // reset is issued by various settings to drain old data out of the queue
     if (resetBuffer) {
+        std::lock_guard<std::mutex> lock(_buf_mutex);
         // drain all buffers from the fifo
-        _buf_head = (_buf_head + _buf_count.exchange(0)) % optNumBuffers;
+        const size_t queued = _buf_count - _buf_held;
+        _buf_head = (_buf_head + queued) % optNumBuffers;
+        _buf_count -= queued;
         resetBuffer = false;
         _overflowEvent = false;
+        _lossElems = 0;
     }
 
     // handle overflow from the rx callback thread
     if (_overflowEvent) {
-        // drain the old buffers from the fifo
-        _buf_head = (_buf_head + _buf_count.exchange(0)) % optNumBuffers;
+        std::lock_guard<std::mutex> lock(_buf_mutex);
+        if (optOverflowPolicy == MIRI_OVERFLOW_DRAIN) {
+            // drain the old buffers from the fifo
+            const size_t queued = _buf_count - _buf_held;
+            for (size_t i = 0; i < queued; i++) {
+                const auto &buff = buffs[_bufOrder[(_buf_head + i) % optNumBuffers]];
+                recordLoss(buff.tick, buff.data.size() / BYTES_PER_SAMPLE / 2);
+            }
+            _buf_head = (_buf_head + queued) % optNumBuffers;
+            _buf_count -= queued;
+        }
         _overflowEvent = false;
+
+        // report where the loss started, the next buffer's timestamp tells where the stream resumes;
+        // the number of samples lost in this event is kept for the 'last_overflow' setting
+        flags = SOAPY_SDR_HAS_TIME;
+        timeNs = this->ticksToTimeNs(_lossIndex);
+        _lastLossIndex = _lossIndex;
+        _lastLossElems = _lossElems;
+        _lossElems = 0;
         SoapySDR::log(SOAPY_SDR_SSI, "O");
+        SoapySDR_logf(SOAPY_SDR_DEBUG, "SoapyMiri overflow: %llu samples lost from sample %llu", _lastLossElems, _lastLossIndex);
         return SOAPY_SDR_OVERFLOW;
     }
 
-    // wait for a buffer to become available
-    if (_buf_count == 0) {
-        std::unique_lock<std::mutex> lock(_buf_mutex);
-        _buf_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this] { return _buf_count != 0; });
-        if (_buf_count == 0) {
-            return SOAPY_SDR_TIMEOUT;
+    // wait for a buffer to become available, skipping stale ones from before a settings transaction;
+    // with the squelch on, only for one the rx thread has let through
+    std::unique_lock<std::mutex> lock(_buf_mutex);
+    auto available = [this] {
+        while (_buf_count != _buf_held && buffs[_bufOrder[_buf_head]].tick < _discardBefore) {
+            _buf_head = (_buf_head + 1) % optNumBuffers;
+            _buf_count--;
         }
+        return _buf_count != _buf_held && (!optSquelch || buffs[_bufOrder[_buf_head]].gate == MIRI_GATE_PASS);
+    };
+    if (!_buf_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), available)) {
+        return SOAPY_SDR_TIMEOUT;
     }
 
-    // extract handle and buffer
-    handle = _buf_head;
+    // extract handle and buffer, under lock since drop_oldest may advance the head from the rx thread
+    handle = _bufOrder[_buf_head];
     _buf_head = (_buf_head + 1) % optNumBuffers;
-    outBuffs[0] = (void *) buffs[handle].data.data();
+    _buf_held++;
+    MIRI_TRACE(EVENT_ACQUIRE, handle);
+    _acquiredTick = buffs[handle].tick;
+    _acquiredArrival = buffs[handle].arrival;
+    if (optStats) {
+        // per-buffer metadata, matched to the data by its start index
+        MiriStatsWindow current = MiriStatsWindow();
+        addStats(current, _acquiredTick, buffs[handle].data.size() / BYTES_PER_SAMPLE / 2, buffs[handle].stats);
+        _lastBufferStats.update([&current](MiriStatsWindow &published) { published = current; });
+    }
+    flags = SOAPY_SDR_HAS_TIME;
+    timeNs = this->ticksToTimeNs(_acquiredTick);
+
+    markFirstSample();
+
+    // flag gaps (drops, squelched stretches) for direct buffer access users
+    if (_acquireNextTickValid && _acquiredTick != _acquireNextTick) {
+        flags |= SOAPY_SDR_END_ABRUPT;
+    }
+    _acquireNextTick = _acquiredTick + buffs[handle].data.size() / BYTES_PER_SAMPLE / 2;
+    _acquireNextTickValid = true;
 
     // return number available
     return buffs[handle].data.size() / BYTES_PER_SAMPLE / 2; // 2 = I/Q, BYTES_PER_SAMPLE = 2 for uint16_t
     // (since we only return 12-bit values wrapped in shorts)
 }
 
+void SoapyMiri::gateBuffers(void) {
+    // caller holds _buf_mutex; runs once per published buffer, so every buffer is decided exactly once:
+    // the new buffer passes or waits, and idle buffers that can't become pre-padding anymore are dropped
+    const size_t queued = _buf_count - _buf_held;
+    const size_t newest = (_buf_head + queued - 1) % optNumBuffers;
+    auto &buff = buffs[_bufOrder[newest]];
+    const size_t elems = buff.data.size() / BYTES_PER_SAMPLE / 2;
+
+    buff.gate = MIRI_GATE_PENDING;
+    if (buff.stats.power >= optSquelchLevel) {
+        buff.gate = MIRI_GATE_PASS;
+        _gateHangUntil = buff.tick + elems + optHangSamples;
+        _gatePostLeft = optSquelchPost;
+
+        // pre-padding: the idle buffers queued just ahead of the activity
+        for (size_t i = 1; i <= optSquelchPre && i < queued; i++) {
+            buffs[_bufOrder[(newest + optNumBuffers - i) % optNumBuffers]].gate = MIRI_GATE_PASS;
+        }
+    } else if (buff.tick < _gateHangUntil) {
+        buff.gate = MIRI_GATE_PASS;
+    } else if (_gatePostLeft != 0) {
+        _gatePostLeft--;
+        buff.gate = MIRI_GATE_PASS;
+    }
+
+    // an idle head with the full pre-padding queued behind it can't be padding anymore
+    while (_buf_count - _buf_held > optSquelchPre && buffs[_bufOrder[_buf_head]].gate == MIRI_GATE_PENDING) {
+        _buf_head = (_buf_head + 1) % optNumBuffers;
+        _buf_count--;
+    }
+}
+
 void SoapyMiri::releaseReadBuffer(SoapySDR::Stream *stream, const size_t handle) {
     //TODO this wont handle out of order releases
+    MIRI_TRACE(EVENT_RELEASE, handle);
+    std::lock_guard<std::mutex> lock(_buf_mutex);
+    _buf_held--;
     _buf_count--;
-}
\ No newline at end of file
+}
+
+/*******************************************************************
+ * Lookback history
+ ******************************************************************/
+
+void SoapyMiri::triggerSnapshot(const SoapySDR::Kwargs &args) {
+    if (_historyElems == 0 || sampleRate <= 0) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: no lookback history, set up the stream with 'history'");
+        return;
+    }
+    if (_snapshotState == MIRI_TRIGGER_PENDING) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: the previous snapshot is still pending");
+        return;
+    }
+    if (_snapshotThread.joinable()) {
+        _snapshotThread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_snapshotMutex);
+        if (_snapshots.size() >= MAX_SNAPSHOTS) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: %d snapshots held in memory, free one with 'trigger_release'",
+                          MAX_SNAPSHOTS);
+            return;
+        }
+    }
+
+    double pre = 1, post = 0;
+    try {
+        if (args.count("pre") != 0) {
+            pre = std::stod(args.at("pre"));
+        }
+        if (args.count("post") != 0) {
+            post = std::stod(args.at("post"));
+        }
+    }
+    catch (const std::logic_error &) {
+        throw std::runtime_error("SoapyMiri trigger: invalid window");
+    }
+
+    const unsigned long long now = _historyWrite;
+    const auto preElems = (unsigned long long) std::max(0.0, pre * sampleRate);
+    const auto postElems = (unsigned long long) std::max(0.0, post * sampleRate);
+    const unsigned long long startTick = now > preElems ? now - preElems : 0;
+    const size_t numElems = (size_t) (now - startTick + postElems);
+
+    // keep a write of headroom (bufflen in bytes bounds the samples per transfer, a replay block
+    // may be larger), the rx thread may be writing next to the window's start
+    if (numElems + std::max<size_t>(optBufferLength, _historyMaxWrite) > _historyElems) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: window of %zu samples doesn't fit the history", numElems);
+        return;
+    }
+
+    std::string path = args.count("path") != 0 ? args.at("path") : "";
+    _snapshotAbort = false;
+    _snapshotState = MIRI_TRIGGER_PENDING;
+    _snapshotThread = std::thread(&SoapyMiri::snapshotOperation, this, startTick, numElems, path, ++_snapshotGeneration);
+}
+
+void SoapyMiri::snapshotOperation(unsigned long long startTick, size_t numElems, std::string path, unsigned generation) {
+    // the rx thread unpacks each callback into the history before it publishes _historyWrite, so up to
+    // one write past it may already be overwritten: the window is intact while the write position
+    // stays a write short of lapping it. A replay writes whole recorded blocks, which can be larger than
+    // a transfer, so the margin is the largest write so far
+    auto intact = [&] {
+        return _historyWrite.load(std::memory_order_acquire) + _historyMaxWrite.load() <= startTick + _historyElems;
+    };
+
+    // live streaming goes on, just wait until the post-trigger part is in the history
+    const unsigned long long endTick = startTick + numElems;
+    while (_historyWrite.load(std::memory_order_acquire) < endTick) {
+        if (_snapshotAbort || !_rxRunning || _paused) {
+            _snapshotState = MIRI_TRIGGER_FAILED;
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    // checked before and after the copy: the copy is only valid if the rx thread didn't come
+    // around to the window before it finished
+    std::vector<int16_t> snapshot;
+    if (intact()) {
+        snapshot.resize(numElems * 2);
+        const size_t pos = startTick % _historyElems;
+        const size_t first = std::min(numElems, _historyElems - pos);
+        std::memcpy(snapshot.data(), _history.data() + pos * 2, first * 2 * sizeof(int16_t));
+        std::memcpy(snapshot.data() + first * 2, _history.data(), (numElems - first) * 2 * sizeof(int16_t));
+    }
+    if (snapshot.empty() || !intact()) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: the history was overwritten while saving the snapshot");
+        _snapshotState = MIRI_TRIGGER_FAILED;
+        return;
+    }
+
+    if (!path.empty()) {
+        std::ofstream out(path, std::ios::binary);
+        out.write((const char *) snapshot.data(), snapshot.size() * sizeof(int16_t));
+        if (!out) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger: cannot write '%s'", path.c_str());
+            _snapshotState = MIRI_TRIGGER_FAILED;
+            return;
+        }
+        SoapySDR_logf(SOAPY_SDR_INFO, "SoapyMiri trigger: saved %zu samples from sample %llu to %s",
+                      numElems, startTick, path.c_str());
+        snapshot.clear();
+    }
+
+    // an in-memory snapshot gets its own buffer, a later trigger never overwrites it
+    {
+        std::lock_guard<std::mutex> lock(_snapshotMutex);
+        if (!snapshot.empty()) {
+            _snapshots[generation] = std::move(snapshot);
+        }
+        _snapshotTick = startTick;
+        _snapshotElems = numElems;
+        _snapshotPath = path;
+    }
+    _snapshotState = MIRI_TRIGGER_READY;
+}
+
+void SoapyMiri::releaseSnapshot(const std::string &which) {
+    std::lock_guard<std::mutex> lock(_snapshotMutex);
+    if (which == "all") {
+        _snapshots.clear();
+        return;
+    }
+    try {
+        if (_snapshots.erase((unsigned) std::stoul(which)) != 0) {
+            return;
+        }
+    }
+    catch (const std::logic_error &) {}
+    SoapySDR_logf(SOAPY_SDR_ERROR, "SoapyMiri trigger_release: no snapshot '%s' held", which.c_str());
+}
+
+std::string SoapyMiri::snapshotStatus(void) const {
+    switch (_snapshotState) {
+        case MIRI_TRIGGER_PENDING:
+            return "pending";
+        case MIRI_TRIGGER_FAILED:
+            return "failed";
+        case MIRI_TRIGGER_READY:
+            break;
+        default:
+            return "idle";
+    }
+
+    // an in-memory snapshot is held until 'trigger_release' frees its generation (or closeStream
+    // frees them all), its samples are copied out with readSnapshot
+    std::lock_guard<std::mutex> lock(_snapshotMutex);
+    SoapySDR::Kwargs status;
+    status["state"] = "ready";
+    status["generation"] = std::to_string(_snapshotGeneration);
+    status["start_index"] = std::to_string(_snapshotTick);
+    status["start_time_ns"] = std::to_string(this->ticksToTimeNs(_snapshotTick));
+    status["samples"] = std::to_string(_snapshotElems);
+    status["path"] = _snapshotPath;
+    status["held"] = _snapshots.count(_snapshotGeneration) != 0 ? "true" : "false";
+    return SoapySDR::KwargsToString(status);
+}
+
+size_t SoapyMiri::readSnapshot(const unsigned generation, const size_t offset, int16_t *out, const size_t numElems) const {
+    // copied under the lock, a trigger_release waits until the copy is done
+    std::lock_guard<std::mutex> lock(_snapshotMutex);
+    const auto snapshot = _snapshots.find(generation);
+    if (snapshot == _snapshots.end() || offset >= snapshot->second.size() / 2) {
+        return 0;
+    }
+    const size_t count = std::min(numElems, snapshot->second.size() / 2 - offset);
+    std::memcpy(out, snapshot->second.data() + offset * 2, count * 2 * sizeof(int16_t));
+    return count;
+}
@@ -0,0 +1,146 @@
+#include "Trace.hpp"
+#include <SoapySDR/Logger.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace MiriTrace {
+
+std::atomic<bool> enabled(false);
+
+#define TRACE_RING_SIZE (1 << 15)
+
+struct Record {
+    uint64_t timeNs;
+    uint64_t arg;
+    Event event;
+};
+
+struct Ring {
+    // single writer (the owning thread), the dump only reads what's behind `head`
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> base; // first entry still of interest, moved forward by clear()
+    uint32_t tid;
+    bool inUse; // guarded by registryMutex
+    Record records[TRACE_RING_SIZE];
+};
+
+// rings outlive their threads so that a dump still sees the events of finished rx threads,
+// a thread that exits hands its ring back and the next new thread continues writing into it
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<Ring>> registry;
+
+struct RingOwner {
+    Ring *ring = nullptr;
+
+    ~RingOwner(void) {
+        if (ring != nullptr) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            ring->inUse = false;
+        }
+    }
+};
+
+static Ring *threadRing(void) {
+    static thread_local RingOwner owner;
+    if (owner.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (const auto &ring : registry) {
+            if (!ring->inUse) {
+                owner.ring = ring.get();
+                break;
+            }
+        }
+        if (owner.ring == nullptr) {
+            std::unique_ptr<Ring> created(new Ring());
+            created->head = 0;
+            created->base = 0;
+            created->tid = (uint32_t) registry.size() + 1;
+            owner.ring = created.get();
+            registry.push_back(std::move(created));
+        }
+        owner.ring->inUse = true;
+    }
+    return owner.ring;
+}
+
+void record(Event event, uint64_t arg) {
+    Ring *ring = threadRing();
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+    Record &rec = ring->records[head & (TRACE_RING_SIZE - 1)];
+    rec.timeNs = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    rec.arg = arg;
+    rec.event = event;
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static const char *eventName(Event event) {
+    switch (event) {
+        case EVENT_CALLBACK: return "callback";
+        case EVENT_RING_PUBLISH: return "ring_publish";
+        case EVENT_ACQUIRE: return "acquire";
+        case EVENT_RELEASE: return "release";
+        case EVENT_CONVERT_BEGIN:
+        case EVENT_CONVERT_END: return "convert";
+        case EVENT_OVERFLOW: return "overflow";
+        case EVENT_RETUNE: return "retune";
+    }
+    return "unknown";
+}
+
+bool dumpChromeJson(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "MiriTrace: cannot open '%s'", path.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &ring : registry) {
+        // entries written while dumping may be torn, dump after disabling for an exact trace
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        begin = std::max(begin, ring->base.load());
+
+        for (uint64_t i = begin; i < head; i++) {
+            const Record &rec = ring->records[i & (TRACE_RING_SIZE - 1)];
+            const char *phase = "i";
+            if (rec.event == EVENT_CONVERT_BEGIN) {
+                phase = "B";
+            } else if (rec.event == EVENT_CONVERT_END) {
+                phase = "E";
+            }
+
+            out << (first ? "\n" : ",\n");
+            out << "{\"name\":\"" << eventName(rec.event) << "\",\"ph\":\"" << phase << "\"";
+            out << ",\"ts\":" << (rec.timeNs / 1000) << "." << (rec.timeNs % 1000 / 100);
+            out << ",\"pid\":1,\"tid\":" << ring->tid;
+            if (phase[0] == 'i') {
+                out << ",\"s\":\"t\"";
+            }
+            out << ",\"args\":{\"v\":" << rec.arg << "}}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+
+    return (bool) out;
+}
+
+void clear(void) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (const auto &ring : registry) {
+        ring->base = ring->head.load();
+    }
+}
+
+}
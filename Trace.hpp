@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*!
+ * Receive path event tracing.
+ * Every thread records into its own lock-free ring, nothing is shared on the hot path.
+ * Compiled out entirely without SOAPY_MIRI_TRACE, otherwise gated by a relaxed atomic load.
+ */
+namespace MiriTrace {
+
+enum Event : uint8_t {
+    EVENT_CALLBACK,
+    EVENT_RING_PUBLISH,
+    EVENT_ACQUIRE,
+    EVENT_RELEASE,
+    EVENT_CONVERT_BEGIN,
+    EVENT_CONVERT_END,
+    EVENT_OVERFLOW,
+    EVENT_RETUNE,
+};
+
+extern std::atomic<bool> enabled;
+
+void record(Event event, uint64_t arg);
+
+// Chrome trace-event JSON, also accepted by the Perfetto UI
+bool dumpChromeJson(const std::string &path);
+
+void clear(void);
+
+}
+
+#ifdef SOAPY_MIRI_TRACE
+#define MIRI_TRACE(event, arg) do { \
+        if (MiriTrace::enabled.load(std::memory_order_relaxed)) \
+            MiriTrace::record(MiriTrace::event, (uint64_t) (arg)); \
+    } while (0)
+#else
+#define MIRI_TRACE(event, arg) do {} while (0)
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Aggregate alignment on simulated dongles: every member sends its own sample counter
+ * (simulate=counter), so the channels of one read must carry the same counter values,
+ * matching the read's timestamp, and a drop on one member must only show up as a flagged gap.
+ */
+
+#include "SoapyMiriAggregate.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        std::fprintf(stderr, __VA_ARGS__); \
+        std::fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static const double RATE = 2048000;
+static const size_t NUM_ELEMS = 3000; // not a multiple of the transfers, leftovers get staged
+
+static long long counterAt(const std::vector<int16_t> &buff, size_t i) {
+    return (long long) buff[i * 2 + 0] | ((long long) buff[i * 2 + 1] << 15);
+}
+
+// one read on both channels, returns the first counter (or -1) and checks the channels against each other
+static long long readAligned(
+        SoapyMiriAggregate &device,
+        SoapySDR::Stream *stream,
+        std::vector<int16_t> (&buffs)[2],
+        int &ret,
+        int &flags) {
+    void *ptrs[] = {buffs[0].data(), buffs[1].data()};
+    long long timeNs = 0;
+    flags = 0;
+    ret = device.readStream(stream, ptrs, NUM_ELEMS, flags, timeNs, 1000000);
+    if (ret <= 0) {
+        return -1;
+    }
+
+    const long long first = counterAt(buffs[0], 0);
+    CHECK((flags & SOAPY_SDR_HAS_TIME) != 0, "read without a timestamp");
+    CHECK(first == std::llround(timeNs * RATE / 1e9), "counter %lld, timestamp %lld ns", first, timeNs);
+    for (size_t i = 0; i < (size_t) ret; i++) {
+        const long long a = counterAt(buffs[0], i);
+        const long long b = counterAt(buffs[1], i);
+        if (a != b || a != first + (long long) i) {
+            CHECK(false, "sample %zu: channel 0 %lld, channel 1 %lld, expected %lld", i, a, b, first + (long long) i);
+            break;
+        }
+    }
+    return first;
+}
+
+int main(void) {
+    SoapySDR::Kwargs args;
+    args["driver"] = "miri";
+    args["simulate"] = "counter";
+    args["serials"] = "a;b";
+    SoapyMiriAggregate device(args);
+    device.setSampleRate(SOAPY_SDR_RX, 0, RATE);
+
+    std::vector<int16_t> buffs[2];
+    buffs[0].resize(NUM_ELEMS * 2);
+    buffs[1].resize(NUM_ELEMS * 2);
+
+    // small transfers so the reads span several of them
+    SoapySDR::Kwargs streamArgs;
+    streamArgs["bufflen"] = "4096";
+    streamArgs["buffers"] = "256";
+    auto stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS16, {0, 1}, streamArgs);
+    device.activateStream(stream);
+
+    // continuous reads line up and follow each other without gaps
+    long long next = -1;
+    for (int n = 0; n < 50; n++) {
+        int ret = 0;
+        int flags = 0;
+        const long long first = readAligned(device, stream, buffs, ret, flags);
+        CHECK(ret > 0, "read %d returned %d", n, ret);
+        if (ret <= 0) {
+            break;
+        }
+        CHECK(next < 0 || first == next, "read %d starts at %lld, expected %lld", n, first, next);
+        CHECK((flags & SOAPY_SDR_END_ABRUPT) == 0, "read %d flagged END_ABRUPT", n);
+        next = first + ret;
+    }
+    // the dongles start one after the other, only the first read may have had to line them up
+    const std::string startEvents = device.readSetting("align_drop_events");
+    CHECK(startEvents == "0" || startEvents == "1", "align_drop_events %s without drops", startEvents.c_str());
+
+    // a dropped transfer on channel 1: the gap shows up once, flagged, and the channels stay aligned
+    device.writeSetting(SOAPY_SDR_RX, 1, "simulate_drop", "1");
+    int abrupt = 0;
+    long long gap = 0;
+    for (int n = 0; n < 50; n++) {
+        int ret = 0;
+        int flags = 0;
+        const long long first = readAligned(device, stream, buffs, ret, flags);
+        CHECK(ret > 0, "read %d after the drop returned %d", n, ret);
+        if (ret <= 0) {
+            break;
+        }
+        if ((flags & SOAPY_SDR_END_ABRUPT) != 0) {
+            abrupt++;
+            gap = first - next;
+        } else {
+            CHECK(first == next, "read %d after the drop starts at %lld, expected %lld", n, first, next);
+        }
+        next = first + ret;
+    }
+    CHECK(abrupt == 1, "%d reads flagged END_ABRUPT for one dropped transfer", abrupt);
+    CHECK(gap == 4096 / 2 / 2, "gap of %lld samples for one dropped transfer", gap);
+    const std::string dropEvents = device.readSetting("align_drop_events");
+    CHECK(std::stoi(dropEvents) == std::stoi(startEvents) + 1, "align_drop_events %s after %s for one drop", dropEvents.c_str(), startEvents.c_str());
+
+    device.deactivateStream(stream);
+    device.closeStream(stream);
+
+    if (failures != 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("aggregate alignment OK\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * The conversion kernels against a scalar reference: every output format with and without
+ * DC removal and power, the plain copy, saturation of the integer formats, and the DC and
+ * power state carried across blocks of odd lengths.
+ */
+
+#include "Conversion.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        std::fprintf(stderr, __VA_ARGS__); \
+        std::fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static bool near(double a, double b) {
+    return std::fabs(a - b) <= 1e-6 + 1e-6 * std::fabs(b);
+}
+
+// converts a few blocks with the selected kernel and the reference side by side
+template <miriSampleFormat FORMAT>
+static void checkConverter(const char *what, bool dcRemoval, bool power, float scale) {
+    typedef typename MiriFormatTraits<FORMAT>::type outType;
+
+    MiriConvertState state;
+    const MiriConvertFn convert = miriSelectConverter(FORMAT, dcRemoval, power, scale, state);
+    MiriConvertState expected = state;
+
+    for (size_t numElems = 1; numElems < 300; numElems += 37) {
+        // a DC offset for the estimate to follow, and full scale codes for the saturation
+        std::vector<int16_t> in(numElems * 2);
+        for (size_t i = 0; i < in.size(); i++) {
+            in[i] = (int16_t) (std::rand() % 65536 - 32768 + (i % 2 == 0 ? 300 : -200));
+        }
+        in[0] = 32767;
+        in[1] = -32768;
+
+        std::vector<outType> out(numElems * 2);
+        convert(in.data(), out.data(), numElems, state);
+
+        const float dcI = dcRemoval ? expected.dcI : 0.0f;
+        const float dcQ = dcRemoval ? expected.dcQ : 0.0f;
+        double sumI = 0, sumQ = 0, powerSum = 0;
+        for (size_t i = 0; i < numElems; i++) {
+            const float vi = (float) in[i * 2 + 0] - dcI;
+            const float vq = (float) in[i * 2 + 1] - dcQ;
+            sumI += in[i * 2 + 0];
+            sumQ += in[i * 2 + 1];
+            const double pi = (double) in[i * 2 + 0] - dcI;
+            const double pq = (double) in[i * 2 + 1] - dcQ;
+            powerSum += pi * pi + pq * pq;
+            const outType ri = MiriFormatTraits<FORMAT>::fromFloat(vi * expected.scale);
+            const outType rq = MiriFormatTraits<FORMAT>::fromFloat(vq * expected.scale);
+            if (out[i * 2 + 0] != ri || out[i * 2 + 1] != rq) {
+                CHECK(false, "%s: sample %zu of %zu is (%g, %g), expected (%g, %g)", what, i, numElems,
+                      (double) out[i * 2 + 0], (double) out[i * 2 + 1], (double) ri, (double) rq);
+                break;
+            }
+        }
+        if (dcRemoval) {
+            expected.dcI += expected.dcAlpha * (float) (sumI / numElems - expected.dcI);
+            expected.dcQ += expected.dcAlpha * (float) (sumQ / numElems - expected.dcQ);
+        }
+        if (power) {
+            expected.powerSum += powerSum;
+            expected.powerCount += numElems;
+        }
+
+        CHECK(near(state.dcI, expected.dcI) && near(state.dcQ, expected.dcQ), "%s: DC estimate (%g, %g), expected (%g, %g)",
+              what, state.dcI, state.dcQ, expected.dcI, expected.dcQ);
+        CHECK(std::fabs(state.powerSum - expected.powerSum) <= 1e-9 * expected.powerSum + 1.0,
+              "%s: power sum %.17g, expected %.17g", what, state.powerSum, expected.powerSum);
+        CHECK(state.powerCount == expected.powerCount, "%s: power count %llu, expected %llu",
+              what, state.powerCount, expected.powerCount);
+    }
+}
+
+int main(void) {
+    std::srand(1);
+
+    // the native format without processing is a plain copy
+    {
+        MiriConvertState state;
+        const MiriConvertFn convert = miriSelectConverter(MIRI_FORMAT_CS16, false, false, 1.0f, state);
+        CHECK(convert == &miriConvertCopy, "CS16 without processing doesn't select the copy");
+        std::vector<int16_t> in(2 * 101), out(2 * 101);
+        for (size_t i = 0; i < in.size(); i++) {
+            in[i] = (int16_t) (std::rand() % 65536 - 32768);
+        }
+        convert(in.data(), out.data(), 101, state);
+        CHECK(in == out, "the copy changed the samples");
+    }
+
+    for (const bool dcRemoval : {false, true}) {
+        for (const bool power : {false, true}) {
+            checkConverter<MIRI_FORMAT_CF32>("CF32", dcRemoval, power, 1.0f);
+            checkConverter<MIRI_FORMAT_CF32>("CF32 scaled", dcRemoval, power, 0.5f);
+            checkConverter<MIRI_FORMAT_CS16>("CS16", dcRemoval, power, 1.0f);
+            checkConverter<MIRI_FORMAT_CS16>("CS16 saturating", dcRemoval, power, 4.0f);
+            checkConverter<MIRI_FORMAT_CS8>("CS8", dcRemoval, power, 1.0f);
+            checkConverter<MIRI_FORMAT_CS8>("CS8 saturating", dcRemoval, power, 3.0f);
+        }
+    }
+
+    if (failures != 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("conversion kernels OK\n");
+    return 0;
+}
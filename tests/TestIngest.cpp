@@ -0,0 +1,136 @@
+/*
+ * The ingest kernels against a scalar reference: known clipping, DC, peak and power for the
+ * int16 and int8 wire types, and odd lengths so the vectorized loop's tail is covered too.
+ */
+
+#include "Conversion.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        std::fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        std::fprintf(stderr, __VA_ARGS__); \
+        std::fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static bool near(double a, double b) {
+    return std::fabs(a - b) <= 1e-6 + 1e-5 * std::fabs(b);
+}
+
+// runs every measure variant on the same wire samples, checks the unpacked output and the stats
+template <typename WIRE>
+static void checkIngest(const char *what, const std::vector<WIRE> &wire, int32_t clipLevel, const MiriBufferStats &expected) {
+    const size_t numElems = wire.size() / 2;
+    const int scale = sizeof(WIRE) == 1 ? 256 : 1;
+
+    for (const auto measure : {MIRI_MEASURE_NONE, MIRI_MEASURE_POWER, MIRI_MEASURE_ALL}) {
+        std::vector<int16_t> out(wire.size());
+        MiriBufferStats stats;
+        stats.power = -1.0f;
+        miriSelectIngest(sizeof(WIRE), measure)(wire.data(), out.data(), numElems, clipLevel, &stats);
+
+        for (size_t i = 0; i < wire.size(); i++) {
+            if (out[i] != (int16_t) (wire[i] * scale)) {
+                CHECK(false, "%s: sample %zu is %d, expected %d", what, i, out[i], wire[i] * scale);
+                break;
+            }
+        }
+        if (measure == MIRI_MEASURE_NONE) {
+            CHECK(stats.power == -1.0f, "%s: stats written without measuring", what);
+            continue;
+        }
+        CHECK(near(stats.power, expected.power), "%s: power %g, expected %g", what, stats.power, expected.power);
+        if (measure == MIRI_MEASURE_ALL) {
+            CHECK(near(stats.peak, expected.peak), "%s: peak %g, expected %g", what, stats.peak, expected.peak);
+            CHECK(near(stats.dcI, expected.dcI), "%s: dc_i %g, expected %g", what, stats.dcI, expected.dcI);
+            CHECK(near(stats.dcQ, expected.dcQ), "%s: dc_q %g, expected %g", what, stats.dcQ, expected.dcQ);
+            CHECK(stats.clipped == expected.clipped, "%s: %u clipped, expected %u", what, stats.clipped, expected.clipped);
+        }
+    }
+}
+
+// the same statistics computed the plain way
+template <typename WIRE>
+static MiriBufferStats reference(const std::vector<WIRE> &wire, int32_t clipLevel) {
+    const int scale = sizeof(WIRE) == 1 ? 256 : 1;
+    const size_t numElems = wire.size() / 2;
+    double power = 0, sumI = 0, sumQ = 0;
+    int32_t peak = 0;
+    uint32_t clipped = 0;
+    for (size_t i = 0; i < numElems; i++) {
+        const int32_t vi = wire[i * 2 + 0] * scale;
+        const int32_t vq = wire[i * 2 + 1] * scale;
+        power += (double) vi * vi + (double) vq * vq;
+        sumI += vi;
+        sumQ += vq;
+        peak = std::max(peak, std::max(std::abs(vi), std::abs(vq)));
+        clipped += (std::abs(vi) >= clipLevel) + (std::abs(vq) >= clipLevel);
+    }
+
+    MiriBufferStats stats;
+    stats.power = (float) (power / numElems / (32768.0 * 32768.0));
+    stats.peak = (float) peak / 32768.0f;
+    stats.dcI = (float) (sumI / numElems / 32768.0);
+    stats.dcQ = (float) (sumQ / numElems / 32768.0);
+    stats.clipped = clipped;
+    return stats;
+}
+
+int main(void) {
+    // 12-bit ADC in 16-bit words: the top code is 32768 - 16
+    {
+        const int32_t clipLevel = 32768 - 16;
+        const std::vector<int16_t> wire = {
+                32752, 2000, -32768, 2000, 100, 2000, -100, 2000,
+                0, 2000, 0, 2000, 16384, 2000, -16384, 2000};
+        MiriBufferStats expected;
+        expected.power = (float) ((32752.0 * 32752 + 32768.0 * 32768 + 2 * 100.0 * 100 + 2 * 16384.0 * 16384 + 8 * 2000.0 * 2000)
+                                  / 8 / (32768.0 * 32768.0));
+        expected.peak = 1.0f;
+        expected.dcI = (float) (-16.0 / 8 / 32768.0);
+        expected.dcQ = (float) (2000.0 / 32768.0);
+        expected.clipped = 2;
+        checkIngest("int16 known", wire, clipLevel, expected);
+    }
+
+    // 8-bit wire samples, scaled up by 256: 127 and -128 are both at the top code
+    {
+        const int32_t clipLevel = 32768 - 256;
+        const std::vector<int8_t> wire = {127, -3, -128, -3, 64, -3, -64, -3, 0, -3, 10, -3, -10, -3, 1, -3};
+        MiriBufferStats expected;
+        expected.power = (float) ((127.0 * 127 + 128.0 * 128 + 2 * 64.0 * 64 + 2 * 10.0 * 10 + 1 + 8 * 9.0) * 65536.0
+                                  / 8 / (32768.0 * 32768.0));
+        expected.peak = 1.0f;
+        expected.dcI = 0.0f; // the I samples sum to 0
+        expected.dcQ = (float) (-3.0 * 256 / 32768.0);
+        expected.clipped = 2;
+        checkIngest("int8 known", wire, clipLevel, expected);
+    }
+
+    // random samples over lengths that end in every position of a vector register
+    std::srand(1);
+    for (size_t numElems = 1; numElems < 80; numElems += 7) {
+        std::vector<int16_t> wide(numElems * 2);
+        std::vector<int8_t> narrow(numElems * 2);
+        for (size_t i = 0; i < numElems * 2; i++) {
+            wide[i] = (int16_t) (std::rand() % 65536 - 32768);
+            narrow[i] = (int8_t) (std::rand() % 256 - 128);
+        }
+        checkIngest("int16 random", wide, 32768 - 4, reference(wide, 32768 - 4));
+        checkIngest("int8 random", narrow, 32768 - 256, reference(narrow, 32768 - 256));
+    }
+
+    if (failures != 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("ingest kernels OK\n");
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Receive path benchmarks on the simulated device (`simulate=true`), no dongle needed.
+ *
+ *   MiriBench activate [--cycles 1000] [--bufflen 36864] [--buffers 15] [--rate 2048000]
+ *       time from activateStream to the first samples out of readStream, over
+ *       activate/read/deactivate cycles like a scanner's
+ *
+ *   MiriBench latency [--seconds 5] [--load-us 0] [--bufflen 16384,36864] [--buffers 4,15] [--rate 2048000]
+ *       time from a transfer's handover to rx_callback until readStream returns it, from the
+ *       timestamps the simulated device embeds in the samples (`simulate=marker`), for every
+ *       bufflen/buffers combination; --load-us busy-waits that long after every read
+ */
+#include "SoapyMiri.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void printPercentiles(const char *what, std::vector<double> values) {
+    if (values.empty()) {
+        return;
+    }
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p) {
+        return values[std::min(values.size() - 1, (size_t) (p * values.size()))];
+    };
+    std::printf("  %-28s p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+                what, percentile(0.5), percentile(0.99), percentile(0.999), values.back());
+}
+
+static int benchActivate(const SoapySDR::Kwargs &options) {
+    const size_t cycles = std::stoul(options.at("cycles"));
+
+    SoapySDR::Kwargs deviceArgs;
+    deviceArgs["simulate"] = "true";
+    SoapyMiri device(deviceArgs);
+    device.setSampleRate(SOAPY_SDR_RX, 0, std::stod(options.at("rate")));
+
+    SoapySDR::Kwargs streamArgs;
+    streamArgs["bufflen"] = options.at("bufflen");
+    streamArgs["buffers"] = options.at("buffers");
+    SoapySDR::Stream *stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CF32, {}, streamArgs);
+
+    std::vector<std::complex<float>> buff(device.getStreamMTU(stream));
+    void *buffs[] = {buff.data()};
+
+    // the first cycle starts the rx thread, the rest only pause and resume it
+    std::vector<double> firstSample, driverLatency;
+    double startUs = 0;
+    for (size_t i = 0; i < cycles; i++) {
+        const auto begin = std::chrono::steady_clock::now();
+        device.activateStream(stream);
+
+        int flags = 0;
+        long long timeNs = 0;
+        while (device.readStream(stream, buffs, buff.size(), flags, timeNs, 1000000) <= 0) {}
+        const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+        if (i == 0) {
+            startUs = us;
+        } else {
+            firstSample.push_back(us);
+            driverLatency.push_back(std::stod(device.readSetting("activate_latency_us")));
+        }
+
+        device.deactivateStream(stream);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    device.closeStream(stream);
+
+    const size_t transferElems = std::stoul(options.at("bufflen")) / BYTES_PER_SAMPLE / 2;
+    const double transferUs = transferElems * 1e6 / device.getSampleRate(SOAPY_SDR_RX, 0);
+    std::printf("activate -> first sample, bufflen %s, buffers %s, one transfer every %.1f us\n",
+                options.at("bufflen").c_str(), options.at("buffers").c_str(), transferUs);
+    std::printf("  %-28s %9.1f us\n", "first activation", startUs);
+    printPercentiles("readStream returned", firstSample);
+    printPercentiles("driver (activate_latency_us)", driverLatency);
+    return 0;
+}
+
+static std::vector<std::string> splitList(const std::string &value) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= value.size()) {
+        const size_t end = std::min(value.find(',', start), value.size());
+        if (end > start) {
+            items.push_back(value.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return items;
+}
+
+static void benchLatencyConfig(const SoapySDR::Kwargs &options, const std::string &bufflen, const std::string &buffers) {
+    const double seconds = std::stod(options.at("seconds"));
+    const auto load = std::chrono::nanoseconds((long long) (std::stod(options.at("load-us")) * 1e3));
+
+    SoapySDR::Kwargs deviceArgs;
+    deviceArgs["simulate"] = "marker";
+    SoapyMiri device(deviceArgs);
+    device.setSampleRate(SOAPY_SDR_RX, 0, std::stod(options.at("rate")));
+
+    SoapySDR::Kwargs streamArgs;
+    streamArgs["bufflen"] = bufflen;
+    streamArgs["buffers"] = buffers;
+    streamArgs["latency"] = "true";
+    SoapySDR::Stream *stream = device.setupStream(SOAPY_SDR_RX, SOAPY_SDR_CS16, {}, streamArgs);
+
+    // one transfer per read, CS16 keeps the marker bits as they were sent
+    const size_t transferElems = std::stoul(bufflen) / BYTES_PER_SAMPLE / 2;
+    std::vector<int16_t> buff(transferElems * 2);
+    void *buffs[] = {buff.data()};
+
+    std::vector<double> latency;
+    device.activateStream(stream);
+    const auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        int flags = 0;
+        long long timeNs = 0;
+        const int ret = device.readStream(stream, buffs, transferElems, flags, timeNs, 1000000);
+        const auto now = std::chrono::steady_clock::now();
+        if (ret < 2) {
+            continue;
+        }
+
+        // only a read that starts at a transfer boundary has the marker in front
+        if (device.timeNsToTicks(timeNs) % transferElems == 0) {
+            uint64_t sentNs = 0;
+            for (size_t k = 0; k < 4; k++) {
+                sentNs |= (uint64_t) (uint16_t) buff[k] << (16 * k);
+            }
+            const auto nowNs = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+            latency.push_back((nowNs - sentNs) / 1e3);
+        }
+
+        // the consumer's own work on the samples
+        const auto busy = std::chrono::steady_clock::now() + load;
+        while (std::chrono::steady_clock::now() < busy) {}
+    }
+    device.deactivateStream(stream);
+
+    double sum = 0, sumSquares = 0;
+    for (const auto us : latency) {
+        sum += us;
+        sumSquares += us * us;
+    }
+    const double mean = latency.empty() ? 0 : sum / latency.size();
+    const double jitter = latency.empty() ? 0 : std::sqrt(std::max(0.0, sumSquares / latency.size() - mean * mean));
+
+    const double transferUs = transferElems * 1e6 / device.getSampleRate(SOAPY_SDR_RX, 0);
+    std::printf("transfer -> readStream, bufflen %s, buffers %s, load %s us, one transfer every %.1f us\n",
+                bufflen.c_str(), buffers.c_str(), options.at("load-us").c_str(), transferUs);
+    printPercentiles("marker", latency);
+    std::printf("  %-28s mean %8.1f  jitter %7.1f us (standard deviation), %zu transfers\n",
+                "", mean, jitter, latency.size());
+    std::printf("  %-28s %s\n", "driver (latency)", device.readSetting("latency").c_str());
+    std::printf("  %-28s %s\n", "dropped_samples", device.readSetting("dropped_samples").c_str());
+    device.closeStream(stream);
+}
+
+static int benchLatency(const SoapySDR::Kwargs &options) {
+    for (const auto &bufflen : splitList(options.at("bufflen"))) {
+        for (const auto &buffers : splitList(options.at("buffers"))) {
+            benchLatencyConfig(options, bufflen, buffers);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const std::string mode = argc > 1 ? argv[1] : "";
+
+    SoapySDR::Kwargs options;
+    options["cycles"] = "1000";
+    options["bufflen"] = std::to_string(DEFAULT_BUFFER_LENGTH);
+    options["buffers"] = std::to_string(DEFAULT_NUM_BUFFERS);
+    options["rate"] = std::to_string(DEFAULT_SIMULATED_RATE);
+    options["seconds"] = "5";
+    options["load-us"] = "0";
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string key = argv[i];
+        if (key.compare(0, 2, "--") != 0 || options.count(key.substr(2)) == 0) {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+        options[key.substr(2)] = argv[i + 1];
+    }
+
+    try {
+        if (mode == "activate") {
+            return benchActivate(options);
+        } else if (mode == "latency") {
+            return benchLatency(options);
+        }
+    }
+    catch (const std::exception &ex) {
+        std::fprintf(stderr, "MiriBench: %s\n", ex.what());
+        return 1;
+    }
+
+    std::fprintf(stderr, "usage: %s activate [--cycles N] [--bufflen BYTES] [--buffers N] [--rate HZ]\n", argv[0]);
+    std::fprintf(stderr, "       %s latency [--seconds S] [--load-us US] [--bufflen BYTES,...] [--buffers N,...] [--rate HZ]\n", argv[0]);
+    return 1;
+}